@@ -2,10 +2,22 @@
 
 struct Entity : UGridEntity
 {
+	uint32_t Id = 0;
 };
 
 #include <chrono>
 #include <random>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
 
 std::mt19937 gen;
 
@@ -18,6 +30,959 @@ randf(
 	return std::uniform_real_distribution<float>(a, b)(gen);
 }
 
+bool
+Overlaps(
+	const Entity& A,
+	const Entity& B
+	)
+{
+	return
+		std::abs(A.Pos.X - B.Pos.X) <= A.Dim.W + B.Dim.W &&
+		std::abs(A.Pos.Y - B.Pos.Y) <= A.Dim.H + B.Dim.H;
+}
+
+/*
+ * Keeps track of how many bytes are allocated through it, to check that the
+ * grid allocates every array through its allocator and frees what it gets.
+ */
+int64_t AllocatedBytes = 0;
+
+template<typename T>
+struct CountingAllocator
+{
+	using value_type = T;
+
+	CountingAllocator() = default;
+
+	template<typename U>
+	CountingAllocator(
+		const CountingAllocator<U>&
+		)
+	{
+	}
+
+	T*
+	allocate(
+		std::size_t Count
+		)
+	{
+		AllocatedBytes += Count * sizeof(T);
+		return std::allocator<T>().allocate(Count);
+	}
+
+	void
+	deallocate(
+		T* Ptr,
+		std::size_t Count
+		)
+	{
+		AllocatedBytes -= Count * sizeof(T);
+		std::allocator<T>().deallocate(Ptr, Count);
+	}
+
+	template<typename U>
+	bool
+	operator==(
+		const CountingAllocator<U>&
+		) const
+	{
+		return true;
+	}
+};
+
+/*
+ * Counts data TLB load misses of the calling thread. Returns -1 if the
+ * kernel does not allow it, as in most containers, and outside Linux.
+ */
+#if defined(__linux__)
+class TLBMissCounter
+{
+private:
+	int Fd;
+public:
+	TLBMissCounter(
+		)
+	{
+		perf_event_attr Attr = {};
+		Attr.size = sizeof(Attr);
+		Attr.type = PERF_TYPE_HW_CACHE;
+		Attr.config = PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		Attr.disabled = 1;
+		Attr.exclude_kernel = 1;
+		Attr.exclude_hv = 1;
+
+		this->Fd = syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+		if(this->Fd != -1)
+		{
+			ioctl(this->Fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(this->Fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	~TLBMissCounter(
+		)
+	{
+		if(this->Fd != -1)
+		{
+			close(this->Fd);
+		}
+	}
+
+	long long
+	Read(
+		)
+	{
+		long long Count;
+		if(this->Fd == -1 || read(this->Fd, &Count, sizeof(Count)) != sizeof(Count))
+		{
+			return -1;
+		}
+
+		return Count;
+	}
+};
+#else
+class TLBMissCounter
+{
+public:
+	long long
+	Read(
+		)
+	{
+		return -1;
+	}
+};
+#endif
+
+std::string
+FormatMisses(
+	long long Count
+	)
+{
+	return Count < 0 ? "dTLB misses unavailable" : std::to_string(Count) + " dTLB misses";
+}
+
+bool
+IsStatic(
+	uint32_t Id
+	)
+{
+	return Id % 3 == 0;
+}
+
+/*
+ * Compares Tick() and Query() against a brute force scan on a small grid with
+ * entities of mixed sizes, some of them sticking out of the grid and every
+ * third one static. With several levels the larger ones go into coarser
+ * levels, in loose mode every entity is in a single cell.
+ */
+template<
+	template<typename, typename> class Storage,
+	typename Allocator = std::allocator<Entity>,
+	template<typename> class Cells = UGridDenseCells
+	>
+bool
+Validate(
+	uint32_t Levels = 1,
+	bool Loose = false
+	)
+{
+	UGridCell GridCells = { 64, 64 };
+	UGridDim CellDim = { 16.0f, 16.0f };
+	UGrid<Entity, Storage, Allocator, Cells> Grid(GridCells, CellDim);
+	Grid.SetLevelCount(Levels);
+	if(Loose)
+	{
+		Grid.SetLoose({ 30.0f, 30.0f });
+	}
+
+	std::vector<Entity> Entities(3000);
+	std::vector<UGridHandle> Handles;
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		Entity& Ent1 = Entities[i];
+		Ent1.Pos = { randf(-20, GridCells.X * CellDim.W + 20), randf(-20, GridCells.Y * CellDim.H + 20) };
+		Ent1.Dim = { randf(1.0f, 30.0f), randf(1.0f, 30.0f) };
+		Ent1.Id = i;
+
+		Handles.push_back(IsStatic(i) ? Grid.InsertStatic(Ent1) : Grid.Insert(Ent1));
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> Expected;
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		for(uint32_t j = i + 1; j < Entities.size(); ++j)
+		{
+			if(!(IsStatic(i) && IsStatic(j)) && Overlaps(Entities[i], Entities[j]))
+			{
+				Expected.push_back({ i, j });
+			}
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> Pairs;
+	Grid.Tick([&](Entity& A, Entity& B)
+	{
+		if(Overlaps(A, B))
+		{
+			Pairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		}
+	});
+
+	std::sort(Pairs.begin(), Pairs.end());
+	if(Pairs != Expected)
+	{
+		std::cout << "Tick reported " << Pairs.size() << " overlapping pairs, expected " << Expected.size() << std::endl;
+		return false;
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> ExactPairs;
+	Grid.template Tick<true>([&](Entity& A, Entity& B)
+	{
+		ExactPairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+	});
+
+	std::sort(ExactPairs.begin(), ExactPairs.end());
+	if(ExactPairs != Expected)
+	{
+		std::cout << "Exact tick reported " << ExactPairs.size() << " pairs, expected " << Expected.size() << std::endl;
+		return false;
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> SerialPairs;
+	Grid.Tick([&](Entity& A, Entity& B)
+	{
+		SerialPairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+	});
+	std::sort(SerialPairs.begin(), SerialPairs.end());
+
+	std::vector<std::pair<uint32_t, uint32_t>> ThreadPairs[7];
+	Grid.Tick([&](uint32_t Thread, Entity& A, Entity& B)
+	{
+		ThreadPairs[Thread].push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+	}, 7);
+
+	std::vector<std::pair<uint32_t, uint32_t>> ParallelPairs;
+	for(auto& Pairs : ThreadPairs)
+	{
+		ParallelPairs.insert(ParallelPairs.end(), Pairs.begin(), Pairs.end());
+	}
+	std::sort(ParallelPairs.begin(), ParallelPairs.end());
+
+	if(ParallelPairs != SerialPairs)
+	{
+		std::cout << "Parallel tick reported " << ParallelPairs.size() << " pairs, expected " << SerialPairs.size() << std::endl;
+		return false;
+	}
+
+	std::vector<UGridFilter> Filters(Entities.size());
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		Filters[i] = { 1u << (i % 3), std::uniform_int_distribution<uint32_t>(0, 7)(gen) };
+		Grid.SetFilter(Handles[i], Filters[i].Category, Filters[i].Mask);
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedFiltered;
+	for(const auto& [i, j] : Expected)
+	{
+		if((Filters[i].Category & Filters[j].Mask) && (Filters[j].Category & Filters[i].Mask))
+		{
+			ExpectedFiltered.push_back({ i, j });
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> FilteredPairs;
+	Grid.template Tick<true>([&](Entity& A, Entity& B)
+	{
+		FilteredPairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+	});
+
+	std::sort(FilteredPairs.begin(), FilteredPairs.end());
+	if(FilteredPairs != ExpectedFiltered)
+	{
+		std::cout << "Filtered tick reported " << FilteredPairs.size() << " pairs, expected " << ExpectedFiltered.size() << std::endl;
+		return false;
+	}
+
+	/* The same filters given on insertion, to the static entities one by
+	 * one and to the rest in bulk */
+	UGrid<Entity, Storage, Allocator, Cells> FilterGrid(GridCells, CellDim);
+	FilterGrid.SetLevelCount(Levels);
+	if(Loose)
+	{
+		FilterGrid.SetLoose({ 30.0f, 30.0f });
+	}
+
+	std::vector<Entity> DynamicEntities;
+	std::vector<UGridFilter> DynamicFilters;
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		if(IsStatic(i))
+		{
+			FilterGrid.InsertStatic(Entities[i], Filters[i]);
+		}
+		else
+		{
+			DynamicEntities.push_back(Entities[i]);
+			DynamicFilters.push_back(Filters[i]);
+		}
+	}
+	FilterGrid.BulkInsert(DynamicEntities, {}, DynamicFilters);
+
+	std::vector<std::pair<uint32_t, uint32_t>> InsertedPairs;
+	FilterGrid.template Tick<true>([&](Entity& A, Entity& B)
+	{
+		InsertedPairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+	});
+
+	std::sort(InsertedPairs.begin(), InsertedPairs.end());
+	if(InsertedPairs != ExpectedFiltered)
+	{
+		std::cout << "Tick with filters given on insertion reported " << InsertedPairs.size() << " pairs, expected " << ExpectedFiltered.size() << std::endl;
+		return false;
+	}
+
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		UGridFilter Filter = Grid.GetFilter(Handles[i]);
+		if(Filter.Category != Filters[i].Category || Filter.Mask != Filters[i].Mask)
+		{
+			std::cout << "Filter of entity " << i << " did not survive a tick" << std::endl;
+			return false;
+		}
+
+		Grid.SetFilter(Handles[i], 1, UINT32_MAX);
+	}
+
+	for(uint32_t i = 0; i < 1000; ++i)
+	{
+		Entity Box;
+		Box.Pos = { randf(-20, GridCells.X * CellDim.W + 20), randf(-20, GridCells.Y * CellDim.H + 20) };
+		Box.Dim = { randf(0.0f, 50.0f), randf(0.0f, 50.0f) };
+
+		std::vector<uint32_t> Found;
+		Grid.Query(Box.Pos, Box.Dim, [&](Entity& Ent1)
+		{
+			Found.push_back(Ent1.Id);
+		});
+		std::sort(Found.begin(), Found.end());
+
+		std::vector<uint32_t> ExpectedFound;
+		for(const Entity& Ent1 : Entities)
+		{
+			if(Overlaps(Ent1, Box))
+			{
+				ExpectedFound.push_back(Ent1.Id);
+			}
+		}
+
+		if(Found != ExpectedFound)
+		{
+			std::cout << "Query found " << Found.size() << " entities, expected " << ExpectedFound.size() << std::endl;
+			return false;
+		}
+	}
+
+	std::vector<UGridBox> Boxes(1000);
+	for(UGridBox& Box : Boxes)
+	{
+		Box.Pos = { randf(-20, GridCells.X * CellDim.W + 20), randf(-20, GridCells.Y * CellDim.H + 20) };
+		Box.Dim = { randf(0.0f, 50.0f), randf(0.0f, 50.0f) };
+	}
+
+	UGridBatchResults Results;
+	Grid.QueryBatch(Boxes, Results);
+
+	for(uint32_t i = 0; i < Boxes.size(); ++i)
+	{
+		std::vector<uint32_t> Found;
+		for(uint32_t j = Results.Offsets[i]; j < Results.Offsets[i + 1]; ++j)
+		{
+			Found.push_back(Grid.Get(Results.Handles[j]).Id);
+		}
+		std::sort(Found.begin(), Found.end());
+
+		std::vector<uint32_t> ExpectedFound;
+		Grid.Query(Boxes[i].Pos, Boxes[i].Dim, [&](Entity& Ent1)
+		{
+			ExpectedFound.push_back(Ent1.Id);
+		});
+		std::sort(ExpectedFound.begin(), ExpectedFound.end());
+
+		if(Found != ExpectedFound)
+		{
+			std::cout << "Batch query found " << Found.size() << " entities, expected " << ExpectedFound.size() << std::endl;
+			return false;
+		}
+	}
+
+	for(uint32_t i = 0; i < 1000; ++i)
+	{
+		UGridPos Center = { randf(-20, GridCells.X * CellDim.W + 20), randf(-20, GridCells.Y * CellDim.H + 20) };
+		float Radius = randf(0.0f, 80.0f);
+
+		std::vector<uint32_t> Found;
+		Grid.QueryCircle(Center, Radius, [&](Entity& Ent1)
+		{
+			Found.push_back(Ent1.Id);
+		});
+		std::sort(Found.begin(), Found.end());
+
+		std::vector<uint32_t> ExpectedFound;
+		for(const Entity& Ent1 : Entities)
+		{
+			float DX = std::max(std::abs(Ent1.Pos.X - Center.X) - Ent1.Dim.W, 0.0f);
+			float DY = std::max(std::abs(Ent1.Pos.Y - Center.Y) - Ent1.Dim.H, 0.0f);
+			if(DX * DX + DY * DY <= Radius * Radius)
+			{
+				ExpectedFound.push_back(Ent1.Id);
+			}
+		}
+
+		if(Found != ExpectedFound)
+		{
+			std::cout << "Circle query found " << Found.size() << " entities, expected " << ExpectedFound.size() << std::endl;
+			return false;
+		}
+	}
+
+	/* Queries reaching far past the occupied cells, which hashed cells
+	 * must not probe one by one, find every entity once */
+	std::vector<uint32_t> FoundFar;
+	Grid.Query({ 0.0f, 0.0f }, { 1e6f, 1e6f }, [&](Entity& Ent1)
+	{
+		FoundFar.push_back(Ent1.Id);
+	});
+	Grid.QueryCircle({ 0.0f, 0.0f }, 1e6f, [&](Entity& Ent1)
+	{
+		FoundFar.push_back(Ent1.Id);
+	});
+	std::sort(FoundFar.begin(), FoundFar.end());
+
+	std::vector<uint32_t> ExpectedFar(2 * Entities.size());
+	for(uint32_t i = 0; i < ExpectedFar.size(); ++i)
+	{
+		ExpectedFar[i] = i / 2;
+	}
+
+	if(FoundFar != ExpectedFar)
+	{
+		std::cout << "Far queries found " << FoundFar.size() << " entities, expected " << ExpectedFar.size() << std::endl;
+		return false;
+	}
+
+	for(uint32_t i = 0; i < 1000; ++i)
+	{
+		UGridPos Point = { randf(-40, GridCells.X * CellDim.W + 40), randf(-40, GridCells.Y * CellDim.H + 40) };
+		uint32_t Count = i % 100 == 0 ? Entities.size() + 5 : i % 32 + 1;
+
+		std::vector<float> Distances;
+		std::vector<uint32_t> Found;
+		Grid.QueryNearest(Point, Count, [&](Entity& Ent1, float Distance)
+		{
+			Distances.push_back(Distance);
+			Found.push_back(Ent1.Id);
+		});
+
+		std::vector<float> ExpectedDistances;
+		for(const Entity& Ent1 : Entities)
+		{
+			float DX = std::max(std::abs(Ent1.Pos.X - Point.X) - Ent1.Dim.W, 0.0f);
+			float DY = std::max(std::abs(Ent1.Pos.Y - Point.Y) - Ent1.Dim.H, 0.0f);
+			ExpectedDistances.push_back(std::sqrt(DX * DX + DY * DY));
+		}
+		std::sort(ExpectedDistances.begin(), ExpectedDistances.end());
+		ExpectedDistances.resize(std::min<size_t>(Count, ExpectedDistances.size()));
+
+		/*
+		 * Floating point contraction may differ from the grid's, so only
+		 * nearly equal distances are required.
+		 */
+		bool Close = Distances.size() == ExpectedDistances.size();
+		for(uint32_t j = 0; Close && j < Distances.size(); ++j)
+		{
+			Close = std::abs(Distances[j] - ExpectedDistances[j]) <= 1e-3f;
+		}
+
+		std::sort(Found.begin(), Found.end());
+		if(!Close || std::adjacent_find(Found.begin(), Found.end()) != Found.end())
+		{
+			std::cout << "Nearest query found " << Found.size() << " entities, expected " << ExpectedDistances.size() << std::endl;
+			return false;
+		}
+	}
+
+	for(uint32_t i = 0; i < 1000; ++i)
+	{
+		UGridPos Origin = { randf(-40, GridCells.X * CellDim.W + 40), randf(-40, GridCells.Y * CellDim.H + 40) };
+		UGridPos Direction = { randf(-1.0f, 1.0f), randf(-1.0f, 1.0f) };
+		if(i % 10 == 0)
+		{
+			Direction.X = 0.0f;
+		}
+		float MaxDistance = i % 4 == 0 ? INFINITY : randf(0.0f, 600.0f);
+
+		std::vector<std::pair<float, uint32_t>> Hits;
+		bool Sorted = true;
+		Grid.Raycast(Origin, Direction, MaxDistance, [&](Entity& Ent1, float Distance)
+		{
+			Sorted &= Hits.empty() || Hits.back().first <= Distance;
+			Hits.push_back({ Distance, Ent1.Id });
+			return true;
+		});
+
+		if(!Sorted)
+		{
+			std::cout << "Raycast hits are not sorted by distance" << std::endl;
+			return false;
+		}
+		std::sort(Hits.begin(), Hits.end());
+
+		std::vector<std::pair<float, uint32_t>> FirstHit;
+		Grid.Raycast(Origin, Direction, MaxDistance, [&](Entity& Ent1, float Distance)
+		{
+			FirstHit.push_back({ Distance, Ent1.Id });
+			return false;
+		});
+
+		if(
+			FirstHit.size() != std::min<size_t>(Hits.size(), 1) ||
+			(!FirstHit.empty() && FirstHit[0].first != Hits[0].first)
+			)
+		{
+			std::cout << "Raycast did not stop at the first hit" << std::endl;
+			return false;
+		}
+
+		float Length = std::sqrt(Direction.X * Direction.X + Direction.Y * Direction.Y);
+		Direction = { Direction.X / Length, Direction.Y / Length };
+
+		std::vector<std::pair<float, uint32_t>> ExpectedHits;
+		for(const Entity& Ent1 : Entities)
+		{
+			float TMin = 0.0f;
+			float TMax = INFINITY;
+			bool Miss = false;
+
+			if(Direction.X != 0.0f)
+			{
+				float T1 = (Ent1.Pos.X - Ent1.Dim.W - Origin.X) / Direction.X;
+				float T2 = (Ent1.Pos.X + Ent1.Dim.W - Origin.X) / Direction.X;
+				TMin = std::max(TMin, std::min(T1, T2));
+				TMax = std::min(TMax, std::max(T1, T2));
+			}
+			else
+			{
+				Miss |= std::abs(Origin.X - Ent1.Pos.X) > Ent1.Dim.W;
+			}
+
+			float T1 = (Ent1.Pos.Y - Ent1.Dim.H - Origin.Y) / Direction.Y;
+			float T2 = (Ent1.Pos.Y + Ent1.Dim.H - Origin.Y) / Direction.Y;
+			TMin = std::max(TMin, std::min(T1, T2));
+			TMax = std::min(TMax, std::max(T1, T2));
+
+			if(!Miss && TMin <= TMax && TMin <= MaxDistance)
+			{
+				ExpectedHits.push_back({ TMin, Ent1.Id });
+			}
+		}
+		std::sort(ExpectedHits.begin(), ExpectedHits.end());
+
+		if(Hits != ExpectedHits)
+		{
+			std::cout << "Raycast hit " << Hits.size() << " entities, expected " << ExpectedHits.size() << std::endl;
+			return false;
+		}
+	}
+
+	/* Rays at 45 degrees through cell corners, which random rays never pass
+	 * exactly, have to visit the diagonal cell */
+	Entity Corners[2];
+	Corners[0].Pos = { 17.0f * CellDim.W, 10.0f * CellDim.H };
+	Corners[0].Dim = { 0.0f, 0.0f };
+	Corners[1].Pos = { 16.5f * CellDim.W, 9.5f * CellDim.H };
+	Corners[1].Dim = { 0.5f * CellDim.W, 0.5f * CellDim.H };
+	UGridPos CornerOrigins[2] = { { 15.0f * CellDim.W, 12.0f * CellDim.H }, { 14.5f * CellDim.W, 10.5f * CellDim.H } };
+
+	for(uint32_t i = 0; i < 2; ++i)
+	{
+		UGrid<Entity, Storage, Allocator, Cells> Single(GridCells, CellDim);
+		Single.SetLevelCount(Levels);
+		if(Loose)
+		{
+			Single.SetLoose({ 30.0f, 30.0f });
+		}
+		Corners[i].Id = i;
+		Single.Insert(Corners[i]);
+
+		bool Hit = false;
+		Single.Raycast(CornerOrigins[i], { 1.0f, -1.0f }, INFINITY, [&](Entity&, float)
+		{
+			Hit = true;
+			return true;
+		});
+
+		if(!Hit)
+		{
+			std::cout << "Raycast through a cell corner missed entity " << i << std::endl;
+			return false;
+		}
+	}
+
+	std::vector<uint32_t> HandleIds(Entities.size() + 1);
+	for(uint32_t i = 0; i < Entities.size(); ++i)
+	{
+		HandleIds[Handles[i].Index] = i;
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> Began;
+	std::vector<std::pair<uint32_t, uint32_t>> Stayed;
+	std::vector<std::pair<uint32_t, uint32_t>> Ended;
+	auto TickContacts = [&]()
+	{
+		Began.clear();
+		Stayed.clear();
+		Ended.clear();
+
+		Grid.TickContacts([&](Entity& A, Entity& B)
+		{
+			Began.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		}, [&](UGridHandle A, UGridHandle B)
+		{
+			uint32_t IdA = HandleIds[A.Index];
+			uint32_t IdB = HandleIds[B.Index];
+			Ended.push_back({ std::min(IdA, IdB), std::max(IdA, IdB) });
+		}, [&](Entity& A, Entity& B)
+		{
+			Stayed.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		});
+
+		std::sort(Began.begin(), Began.end());
+		std::sort(Stayed.begin(), Stayed.end());
+		std::sort(Ended.begin(), Ended.end());
+	};
+
+	TickContacts();
+	if(Began != Expected || !Stayed.empty() || !Ended.empty())
+	{
+		std::cout << "First contact tick began " << Began.size() << " contacts, expected " << Expected.size() << std::endl;
+		return false;
+	}
+
+	for(uint32_t i = 0; i < 300; ++i)
+	{
+		Entity& Ent1 = Entities[std::uniform_int_distribution<uint32_t>(1, Entities.size() - 1)(gen)];
+		Ent1.Pos.X += randf(-10.0f, 10.0f);
+		Ent1.Pos.Y += randf(-10.0f, 10.0f);
+		Grid.Update(Handles[Ent1.Id], Ent1.Pos, Ent1.Dim);
+	}
+
+	for(uint32_t i = 0; i < Handles.size(); ++i)
+	{
+		if(!Grid.IsValid(Handles[i]))
+		{
+			std::cout << "Handle of entity " << i << " is invalid after a tick" << std::endl;
+			return false;
+		}
+	}
+
+	Grid.Remove(Handles[0]);
+	if(Grid.IsValid(Handles[0]))
+	{
+		std::cout << "Handle of entity 0 is valid after removal" << std::endl;
+		return false;
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> Overlapping;
+	for(uint32_t i = 1; i < Entities.size(); ++i)
+	{
+		for(uint32_t j = i + 1; j < Entities.size(); ++j)
+		{
+			if(!(IsStatic(i) && IsStatic(j)) && Overlaps(Entities[i], Entities[j]))
+			{
+				Overlapping.push_back({ i, j });
+			}
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedBegan;
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedStayed;
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedEnded;
+	std::set_difference(Overlapping.begin(), Overlapping.end(), Expected.begin(), Expected.end(), std::back_inserter(ExpectedBegan));
+	std::set_intersection(Overlapping.begin(), Overlapping.end(), Expected.begin(), Expected.end(), std::back_inserter(ExpectedStayed));
+	std::set_difference(Expected.begin(), Expected.end(), Overlapping.begin(), Overlapping.end(), std::back_inserter(ExpectedEnded));
+
+	TickContacts();
+	if(Began != ExpectedBegan || Stayed != ExpectedStayed || Ended != ExpectedEnded)
+	{
+		std::cout << "Contact tick began " << Began.size() << ", kept " << Stayed.size() << " and ended " << Ended.size() <<
+			" contacts, expected " << ExpectedBegan.size() << ", " << ExpectedStayed.size() << " and " << ExpectedEnded.size() << std::endl;
+		return false;
+	}
+
+	/* Sleeping pairs are not ticked but stay in contact, through falling
+	 * asleep and waking up again */
+	for(uint32_t i = 1; i < Entities.size(); ++i)
+	{
+		Grid.Sleep(Handles[i]);
+	}
+
+	TickContacts();
+	if(!Began.empty() || Stayed != Overlapping || !Ended.empty())
+	{
+		std::cout << "Sleeping contact tick began " << Began.size() << ", kept " << Stayed.size() << " and ended " << Ended.size() <<
+			" contacts, expected 0, " << Overlapping.size() << " and 0" << std::endl;
+		return false;
+	}
+
+	for(uint32_t i = 1; i < Entities.size(); ++i)
+	{
+		Grid.Wake(Handles[i]);
+	}
+
+	TickContacts();
+	if(!Began.empty() || Stayed != Overlapping || !Ended.empty())
+	{
+		std::cout << "Woken contact tick began " << Began.size() << ", kept " << Stayed.size() << " and ended " << Ended.size() <<
+			" contacts, expected 0, " << Overlapping.size() << " and 0" << std::endl;
+		return false;
+	}
+
+	std::vector<bool> Asleep(Entities.size());
+	for(uint32_t i = 1; i < Entities.size(); ++i)
+	{
+		if(!IsStatic(i) && i % 2 == 0)
+		{
+			Grid.Sleep(Handles[i]);
+			Asleep[i] = true;
+		}
+	}
+
+	auto IsAwake = [&](uint32_t Id)
+	{
+		return !IsStatic(Id) && !Asleep[Id];
+	};
+
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedAwake;
+	for(const auto& [i, j] : Overlapping)
+	{
+		if(IsAwake(i) || IsAwake(j))
+		{
+			ExpectedAwake.push_back({ i, j });
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> AwakePairs;
+	Grid.Tick([&](Entity& A, Entity& B)
+	{
+		if(Overlaps(A, B))
+		{
+			AwakePairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		}
+	});
+
+	std::sort(AwakePairs.begin(), AwakePairs.end());
+	if(AwakePairs != ExpectedAwake)
+	{
+		std::cout << "Tick with sleeping entities reported " << AwakePairs.size() << " pairs, expected " << ExpectedAwake.size() << std::endl;
+		return false;
+	}
+
+	for(uint32_t i = 1; i < Entities.size(); ++i)
+	{
+		bool Touched = false;
+		for(uint32_t j = 1; j < Entities.size(); ++j)
+		{
+			Touched |= j != i && IsAwake(j) && Overlaps(Entities[i], Entities[j]);
+		}
+
+		if(Grid.IsAsleep(Handles[i]) != (Asleep[i] && !Touched))
+		{
+			std::cout << "Entity " << i << " is " << (Grid.IsAsleep(Handles[i]) ? "asleep" : "awake") << " after a tick" << std::endl;
+			return false;
+		}
+
+		Grid.Wake(Handles[i]);
+		if(Grid.IsAsleep(Handles[i]) || Grid.Get(Handles[i]).Id != i)
+		{
+			std::cout << "Entity " << i << " did not wake up" << std::endl;
+			return false;
+		}
+	}
+
+	/* A sparse grid whose columns do not fill whole occupancy words, half
+	 * of it bulk inserted on top of the other half, with cells emptied by
+	 * moves, resizes and removals before ticking */
+	UGrid<Entity, Storage, Allocator, Cells> SparseGrid({ 100, 75 }, CellDim);
+	SparseGrid.SetLevelCount(Levels);
+	if(Loose)
+	{
+		SparseGrid.SetLoose({ 40.0f, 40.0f });
+	}
+
+	/* Nothing bulk inserted into a new grid, before its spare arrays exist */
+	SparseGrid.BulkInsert(std::span<const Entity>());
+
+	std::vector<Entity> SparseEntities(200);
+	std::vector<UGridHandle> SparseHandles(SparseEntities.size());
+	for(uint32_t i = 0; i < SparseEntities.size(); ++i)
+	{
+		Entity& Ent1 = SparseEntities[i];
+		Ent1.Pos = { randf(0, 100 * CellDim.W), randf(0, 75 * CellDim.H) };
+		Ent1.Dim = { randf(1.0f, 20.0f), randf(1.0f, 20.0f) };
+		Ent1.Id = i;
+
+		if(i < SparseEntities.size() / 2)
+		{
+			SparseHandles[i] = SparseGrid.Insert(Ent1);
+		}
+	}
+
+	uint32_t Half = SparseEntities.size() / 2;
+	SparseGrid.BulkInsert(
+		std::span<const Entity>(SparseEntities).subspan(Half),
+		std::span<UGridHandle>(SparseHandles).subspan(Half)
+		);
+
+	SparseGrid.Tick([](Entity&, Entity&)
+	{
+	});
+
+	/* With several levels the loose bound grows with the level, so the
+	 * largest entities only fit into the coarser ones */
+	float MaxDim = 40.0f * (1u << (Levels - 1));
+	std::vector<bool> Removed(SparseEntities.size());
+	for(uint32_t i = 0; i < SparseEntities.size(); ++i)
+	{
+		if(i % 4 == 0)
+		{
+			SparseGrid.Remove(SparseHandles[i]);
+			Removed[i] = true;
+			continue;
+		}
+
+		SparseEntities[i].Pos = { randf(0, 100 * CellDim.W), randf(0, 75 * CellDim.H) };
+		SparseEntities[i].Dim = { randf(1.0f, MaxDim), randf(1.0f, MaxDim) };
+		SparseGrid.Update(SparseHandles[i], SparseEntities[i].Pos, SparseEntities[i].Dim);
+	}
+
+	/* A removed entity's slot is handed out again under a new generation,
+	 * the old handle has to stay invalid */
+	UGridHandle Reused = SparseGrid.Insert(SparseEntities[0]);
+	for(uint32_t i = 0; i < SparseEntities.size(); ++i)
+	{
+		if(Removed[i] && SparseGrid.IsValid(SparseHandles[i]))
+		{
+			std::cout << "Handle of removed entity " << i << " is valid after reinsertion" << std::endl;
+			return false;
+		}
+		if(Removed[i] && SparseHandles[i].Index == Reused.Index && SparseHandles[i].Generation == Reused.Generation)
+		{
+			std::cout << "Reused handle slot " << Reused.Index << " kept its generation" << std::endl;
+			return false;
+		}
+	}
+	if(!SparseGrid.IsValid(Reused) || !std::any_of(SparseHandles.begin(), SparseHandles.end(), [&](UGridHandle Handle)
+	{
+		return Handle.Index == Reused.Index;
+	}))
+	{
+		std::cout << "Reinserted entity did not reuse a removed handle slot" << std::endl;
+		return false;
+	}
+	SparseGrid.Remove(Reused);
+
+	/* Boxes larger than the loose bound are rejected without leaving
+	 * anything behind, which the sparse tick below checks */
+	if(Loose)
+	{
+		Entity Oversized;
+		Oversized.Pos = { 50.0f * CellDim.W, 30.0f * CellDim.H };
+		Oversized.Dim = { 10.0f, MaxDim + 1.0f };
+		Entity Batch[2] = { SparseEntities[1], Oversized };
+
+		uint32_t Rejected = 0;
+		try
+		{
+			SparseGrid.Insert(Oversized);
+		}
+		catch(const std::invalid_argument&)
+		{
+			++Rejected;
+		}
+		try
+		{
+			SparseGrid.BulkInsert(Batch);
+		}
+		catch(const std::invalid_argument&)
+		{
+			++Rejected;
+		}
+		try
+		{
+			SparseGrid.Update(SparseHandles[1], Oversized.Pos, Oversized.Dim);
+		}
+		catch(const std::invalid_argument&)
+		{
+			++Rejected;
+		}
+
+		if(Rejected != 3)
+		{
+			std::cout << "Loose grid rejected " << Rejected << " oversized entities, expected 3" << std::endl;
+			return false;
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> ExpectedSparse;
+	for(uint32_t i = 0; i < SparseEntities.size(); ++i)
+	{
+		for(uint32_t j = i + 1; j < SparseEntities.size(); ++j)
+		{
+			if(!Removed[i] && !Removed[j] && Overlaps(SparseEntities[i], SparseEntities[j]))
+			{
+				ExpectedSparse.push_back({ i, j });
+			}
+		}
+	}
+
+	std::vector<std::pair<uint32_t, uint32_t>> SparsePairs;
+	SparseGrid.Tick([&](Entity& A, Entity& B)
+	{
+		if(Overlaps(A, B))
+		{
+			SparsePairs.push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		}
+	});
+
+	std::vector<std::pair<uint32_t, uint32_t>> SparseThreadPairs[7];
+	SparseGrid.Tick([&](uint32_t Thread, Entity& A, Entity& B)
+	{
+		if(Overlaps(A, B))
+		{
+			SparseThreadPairs[Thread].push_back({ std::min(A.Id, B.Id), std::max(A.Id, B.Id) });
+		}
+	}, 7);
+
+	std::vector<std::pair<uint32_t, uint32_t>> SparseParallelPairs;
+	for(auto& Pairs : SparseThreadPairs)
+	{
+		SparseParallelPairs.insert(SparseParallelPairs.end(), Pairs.begin(), Pairs.end());
+	}
+
+	std::sort(SparsePairs.begin(), SparsePairs.end());
+	std::sort(SparseParallelPairs.begin(), SparseParallelPairs.end());
+	if(SparsePairs != ExpectedSparse || SparseParallelPairs != ExpectedSparse)
+	{
+		std::cout << "Sparse tick reported " << SparsePairs.size() << " and " << SparseParallelPairs.size() <<
+			" pairs, expected " << ExpectedSparse.size() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
 int
 main(
 	)
@@ -25,11 +990,32 @@ main(
 	std::random_device rd;
 	gen = std::mt19937(rd());
 
+	if(
+		!Validate<UGridAoSStorage>() ||
+		!Validate<UGridSoAStorage, CountingAllocator<Entity>>() ||
+		!Validate<UGridAoSStorage, CountingAllocator<Entity>, UGridHashedCells>() ||
+		!Validate<UGridSoAStorage, CountingAllocator<Entity>>(4) ||
+		!Validate<UGridAoSStorage, CountingAllocator<Entity>, UGridHashedCells>(4) ||
+		!Validate<UGridAoSStorage>(1, true) ||
+		!Validate<UGridSoAStorage, CountingAllocator<Entity>, UGridHashedCells>(4, true)
+		)
+	{
+		return 1;
+	}
+
+	if(AllocatedBytes != 0)
+	{
+		std::cout << AllocatedBytes << " bytes allocated through the grid's allocator were not freed" << std::endl;
+		return 1;
+	}
+
 	UGridCell GridCells = { 2048, 2048 };
 	UGridDim CellDim = { 16.0f, 16.0f };
 	UGrid<Entity> Grid(GridCells, CellDim);
 
 
+	std::vector<UGridHandle> Handles;
+	std::vector<UGridPos> Positions;
 	auto start = std::chrono::high_resolution_clock::now();
 
 	for(uint32_t i = 0; i < 500000; ++i)
@@ -38,7 +1024,8 @@ main(
 		Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
 		Ent1.Dim = { 7.0f, 7.0f };
 
-		Grid.Insert(Ent1);
+		Handles.push_back(Grid.Insert(Ent1));
+		Positions.push_back(Ent1.Pos);
 	}
 
 	auto end = std::chrono::high_resolution_clock::now();
@@ -46,11 +1033,641 @@ main(
 	std::cout << "Elapsed insertion time: " << duration.count() << " milliseconds" << std::endl;
 
 
+	{
+		std::vector<Entity> Bulk(500000);
+		for(Entity& Ent1 : Bulk)
+		{
+			Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			Ent1.Dim = { 7.0f, 7.0f };
+		}
+
+		UGrid<Entity> BulkGrid(GridCells, CellDim);
+
+		start = std::chrono::high_resolution_clock::now();
+
+		BulkGrid.BulkInsert(Bulk);
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed bulk insertion time: " << duration.count() << " milliseconds" << std::endl;
+
+
+		start = std::chrono::high_resolution_clock::now();
+
+		uint32_t Collisions = 0;
+		BulkGrid.Tick([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed bulk tick time: " << duration.count() << " milliseconds" << std::endl;
+		std::cout << Collisions << " registered broad collisions" << std::endl;
+
+
+		UGrid<Entity, UGridSoAStorage> SoAGrid(GridCells, CellDim);
+		SoAGrid.BulkInsert(Bulk);
+
+		start = std::chrono::high_resolution_clock::now();
+
+		Collisions = 0;
+		SoAGrid.Tick([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed SoA tick time: " << duration.count() << " milliseconds" << std::endl;
+		std::cout << Collisions << " registered broad collisions" << std::endl;
+
+
+		start = std::chrono::high_resolution_clock::now();
+
+		uint32_t Found = 0;
+		for(uint32_t i = 0; i < 200000; ++i)
+		{
+			UGridPos Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			SoAGrid.Query(Pos, { 32.0f, 32.0f }, [&](Entity&)
+			{
+				++Found;
+			});
+		}
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed SoA query time: " << duration.count() << " milliseconds" << std::endl;
+		std::cout << Found << " entities found by queries" << std::endl;
+	}
+
+
 	start = std::chrono::high_resolution_clock::now();
 
-	Grid.Tick();
+	for(uint32_t i = 0; i < 500000; i += 20)
+	{
+		Grid.Remove(Handles[i]);
+
+		Entity Ent1;
+		Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		Ent1.Dim = { 7.0f, 7.0f };
+
+		Handles[i] = Grid.Insert(Ent1);
+		Positions[i] = Ent1.Pos;
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed churn time: " << duration.count() << " milliseconds" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < 500000; ++i)
+	{
+		UGridPos& Pos = Positions[i];
+		Pos = { Pos.X + randf(-2.0f, 2.0f), Pos.Y + randf(-2.0f, 2.0f) };
+		Grid.Update(Handles[i], Pos, { 7.0f, 7.0f });
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed update time: " << duration.count() << " milliseconds" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	uint32_t Collisions = 0;
+	Grid.Tick([&](Entity&, Entity&)
+	{
+		++Collisions;
+	});
 
 	end = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 	std::cout << "Elapsed tick time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Collisions << " registered broad collisions" << std::endl;
+
+
+	rusage Usage;
+	getrusage(RUSAGE_SELF, &Usage);
+	long Faults = Usage.ru_minflt;
+	start = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < 10; ++i)
+	{
+		Grid.Tick([](Entity&, Entity&)
+		{
+		});
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	getrusage(RUSAGE_SELF, &Usage);
+	std::cout << "Elapsed time of 10 ticks: " << duration.count() << " milliseconds (" <<
+		(Usage.ru_minflt - Faults) / 10 << " page faults per tick)" << std::endl;
+
+
+	{
+		UGrid<Entity, UGridAoSStorage, UGridHugePageAllocator<Entity>> HugeGrid(GridCells, CellDim);
+		UGrid<Entity> SmallGrid(GridCells, CellDim);
+		for(const UGridPos& Pos : Positions)
+		{
+			Entity Ent1;
+			Ent1.Pos = Pos;
+			Ent1.Dim = { 7.0f, 7.0f };
+			HugeGrid.Insert(Ent1);
+			SmallGrid.Insert(Ent1);
+		}
+
+		/* Alternate the two grids and keep the best of five ticks, so
+		 * neither side is favoured by warm caches or a noisy neighbour */
+		auto TimeTick = [&](auto& Target, long long& Misses)
+		{
+			uint32_t TickCollisions = 0;
+			TLBMissCounter Counter;
+			auto TickStart = std::chrono::high_resolution_clock::now();
+
+			Target.Tick([&](Entity&, Entity&)
+			{
+				++TickCollisions;
+			});
+
+			auto TickEnd = std::chrono::high_resolution_clock::now();
+			Misses = Counter.Read();
+			Collisions = TickCollisions;
+			return std::chrono::duration_cast<std::chrono::milliseconds>(TickEnd - TickStart);
+		};
+
+		std::chrono::milliseconds HugeDuration = std::chrono::milliseconds::max();
+		std::chrono::milliseconds SmallDuration = std::chrono::milliseconds::max();
+		long long HugeMisses = -1;
+		long long SmallMisses = -1;
+		for(uint32_t i = 0; i < 5; ++i)
+		{
+			long long Misses;
+			std::chrono::milliseconds Elapsed = TimeTick(SmallGrid, Misses);
+			if(Elapsed < SmallDuration)
+			{
+				SmallDuration = Elapsed;
+				SmallMisses = Misses;
+			}
+
+			Elapsed = TimeTick(HugeGrid, Misses);
+			if(Elapsed < HugeDuration)
+			{
+				HugeDuration = Elapsed;
+				HugeMisses = Misses;
+			}
+		}
+
+		std::cout << "Elapsed tick time with 4K pages: " << SmallDuration.count() << " milliseconds (" <<
+			FormatMisses(SmallMisses) << ")" << std::endl;
+		std::cout << "Elapsed tick time with huge pages: " << HugeDuration.count() << " milliseconds (" <<
+			FormatMisses(HugeMisses) << ")" << std::endl;
+	}
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Collisions = 0;
+	Grid.Tick<true>([&](Entity&, Entity&)
+	{
+		++Collisions;
+	});
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed exact tick time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Collisions << " registered exact collisions" << std::endl;
+
+
+	/* Every other entity becomes a bullet that only hits the rest */
+	for(uint32_t i = 0; i < Handles.size(); i += 2)
+	{
+		Grid.SetFilter(Handles[i], 2, 1);
+	}
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Collisions = 0;
+	Grid.Tick([&](Entity&, Entity&)
+	{
+		++Collisions;
+	});
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed filtered tick time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Collisions << " registered filtered collisions" << std::endl;
+
+	for(uint32_t i = 0; i < Handles.size(); i += 2)
+	{
+		Grid.SetFilter(Handles[i], 1, UINT32_MAX);
+	}
+
+
+	auto Ignore = [](auto&, auto&)
+	{
+	};
+	Grid.TickContacts(Ignore, Ignore);
+
+	for(uint32_t i = 0; i < Handles.size(); i += 20)
+	{
+		Positions[i].X += randf(-2.0f, 2.0f);
+		Positions[i].Y += randf(-2.0f, 2.0f);
+		Grid.Update(Handles[i], Positions[i], { 7.0f, 7.0f });
+	}
+
+	start = std::chrono::high_resolution_clock::now();
+
+	uint32_t Events = 0;
+	uint32_t Contacts = 0;
+	Grid.TickContacts([&](Entity&, Entity&)
+	{
+		++Events;
+	}, [&](UGridHandle, UGridHandle)
+	{
+		++Events;
+	}, [&](Entity&, Entity&)
+	{
+		++Contacts;
+	});
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed contact tick time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Events << " contact events, " << Contacts << " unchanged contacts" << std::endl;
+
+
+	{
+		/* Same density with 60% of the entities static */
+		UGrid<Entity> MixedGrid(GridCells, CellDim);
+		for(uint32_t i = 0; i < 500000; ++i)
+		{
+			Entity Ent1;
+			Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			Ent1.Dim = { 7.0f, 7.0f };
+
+			if(i % 5 < 3)
+			{
+				MixedGrid.InsertStatic(Ent1);
+			}
+			else
+			{
+				MixedGrid.Insert(Ent1);
+			}
+		}
+
+		MixedGrid.Tick([](Entity&, Entity&)
+		{
+		});
+
+		start = std::chrono::high_resolution_clock::now();
+
+		Collisions = 0;
+		MixedGrid.Tick([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed static split tick time: " << duration.count() << " milliseconds" << std::endl;
+		std::cout << Collisions << " registered broad collisions" << std::endl;
+	}
+
+
+	for(uint32_t i = 0; i < Handles.size(); ++i)
+	{
+		if(i % 5)
+		{
+			Grid.Sleep(Handles[i]);
+		}
+	}
+
+	Grid.Tick([](Entity&, Entity&)
+	{
+	});
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Collisions = 0;
+	Grid.Tick([&](Entity&, Entity&)
+	{
+		++Collisions;
+	});
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed mostly asleep tick time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Collisions << " registered broad collisions" << std::endl;
+
+	for(UGridHandle Handle : Handles)
+	{
+		Grid.Wake(Handle);
+	}
+	Grid.Tick([](Entity&, Entity&)
+	{
+	});
+
+
+	{
+		/* 100k entities over 16M cells, over 99% of which stay empty */
+		UGridCell SparseCells = { 4096, 4096 };
+		UGrid<Entity> SparseGrid(SparseCells, CellDim);
+		for(uint32_t i = 0; i < 100000; ++i)
+		{
+			Entity Ent1;
+			Ent1.Pos = { randf(0, SparseCells.X * CellDim.W), randf(0, SparseCells.Y * CellDim.H) };
+			Ent1.Dim = { 7.0f, 7.0f };
+			SparseGrid.Insert(Ent1);
+		}
+
+		SparseGrid.Tick([](Entity&, Entity&)
+		{
+		});
+
+		start = std::chrono::high_resolution_clock::now();
+
+		Collisions = 0;
+		SparseGrid.Tick([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed sparse tick time: " << duration.count() << " milliseconds" << std::endl;
+		std::cout << Collisions << " registered broad collisions" << std::endl;
+
+
+		/* The same map in hashed cells, and then spread over 100k x 100k
+		 * cells, which would take 40 GB of dense cells */
+		for(float Side : { SparseCells.X * CellDim.W, 100000 * CellDim.W })
+		{
+			UGrid<Entity, UGridAoSStorage, std::allocator<Entity>, UGridHashedCells> HashedGrid(SparseCells, CellDim);
+			for(uint32_t i = 0; i < 100000; ++i)
+			{
+				Entity Ent1;
+				Ent1.Pos = { randf(0, Side), randf(0, Side) };
+				Ent1.Dim = { 7.0f, 7.0f };
+				HashedGrid.Insert(Ent1);
+			}
+
+			HashedGrid.Tick([](Entity&, Entity&)
+			{
+			});
+
+			start = std::chrono::high_resolution_clock::now();
+
+			Collisions = 0;
+			HashedGrid.Tick([&](Entity&, Entity&)
+			{
+				++Collisions;
+			});
+
+			end = std::chrono::high_resolution_clock::now();
+			duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+			std::cout << "Elapsed hashed tick time over " << uint32_t(Side / CellDim.W) << " cells square: " <<
+				duration.count() << " milliseconds (" << Collisions << " registered broad collisions)" << std::endl;
+		}
+	}
+
+
+	/* 1000 bosses 500 units wide among 100k small entities, moved every
+	 * tick. A single level puts each of them into over a thousand cells */
+	for(uint32_t Levels : { 1, 6 })
+	{
+		UGrid<Entity> LevelGrid(GridCells, CellDim);
+		LevelGrid.SetLevelCount(Levels);
+		for(uint32_t i = 0; i < 100000; ++i)
+		{
+			Entity Ent1;
+			Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			Ent1.Dim = { 7.0f, 7.0f };
+			LevelGrid.Insert(Ent1);
+		}
+
+		std::vector<UGridHandle> Bosses;
+		for(uint32_t i = 0; i < 1000; ++i)
+		{
+			Entity Ent1;
+			Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			Ent1.Dim = { 250.0f, 250.0f };
+			Bosses.push_back(LevelGrid.Insert(Ent1));
+		}
+
+		LevelGrid.Tick([](Entity&, Entity&)
+		{
+		});
+
+		start = std::chrono::high_resolution_clock::now();
+
+		for(UGridHandle Boss : Bosses)
+		{
+			Entity& Ent1 = LevelGrid.Get(Boss);
+			LevelGrid.Update(Boss, { Ent1.Pos.X + randf(-8.0f, 8.0f), Ent1.Pos.Y + randf(-8.0f, 8.0f) }, Ent1.Dim);
+		}
+
+		Collisions = 0;
+		LevelGrid.Tick([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed tick time with bosses over " << Levels << " levels: " <<
+			duration.count() << " milliseconds (" << Collisions << " registered broad collisions)" << std::endl;
+	}
+
+
+	/* Every entity moved and then an exact tick, with each entity in every
+	 * cell its box touches and in loose cells */
+	for(bool Loose : { false, true })
+	{
+		UGrid<Entity> LooseGrid(GridCells, CellDim);
+		if(Loose)
+		{
+			LooseGrid.SetLoose({ 7.0f, 7.0f });
+		}
+
+		std::vector<UGridHandle> LooseHandles;
+		for(uint32_t i = 0; i < 500000; ++i)
+		{
+			Entity Ent1;
+			Ent1.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+			Ent1.Dim = { 7.0f, 7.0f };
+			LooseHandles.push_back(LooseGrid.Insert(Ent1));
+		}
+
+		LooseGrid.Tick([](Entity&, Entity&)
+		{
+		});
+
+		start = std::chrono::high_resolution_clock::now();
+
+		for(UGridHandle Handle : LooseHandles)
+		{
+			Entity& Ent1 = LooseGrid.Get(Handle);
+			LooseGrid.Update(Handle, { Ent1.Pos.X + randf(-2.0f, 2.0f), Ent1.Pos.Y + randf(-2.0f, 2.0f) }, Ent1.Dim);
+		}
+
+		end = std::chrono::high_resolution_clock::now();
+		auto UpdateDuration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		start = end;
+
+		Collisions = 0;
+		LooseGrid.Tick<true>([&](Entity&, Entity&)
+		{
+			++Collisions;
+		});
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		std::cout << "Elapsed " << (Loose ? "loose" : "regular") << " update time: " << UpdateDuration.count() <<
+			" milliseconds, exact tick time: " << duration.count() << " milliseconds (" << Collisions << " registered exact collisions)" << std::endl;
+	}
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	float Sum = 0.0f;
+	for(UGridHandle Handle : Handles)
+	{
+		Sum += Grid.Get(Handle).Pos.X;
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed handle access time: " << duration.count() << " milliseconds (" << Sum << ")" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	uint32_t Found = 0;
+	for(uint32_t i = 0; i < 200000; ++i)
+	{
+		UGridPos Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		Grid.Query(Pos, { 32.0f, 32.0f }, [&](Entity&)
+		{
+			++Found;
+		});
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed query time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Found << " entities found by queries" << std::endl;
+
+
+	std::vector<UGridBox> Boxes(200000);
+	for(UGridBox& Box : Boxes)
+	{
+		Box.Pos = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		Box.Dim = { 32.0f, 32.0f };
+	}
+
+	UGridBatchResults Results;
+	start = std::chrono::high_resolution_clock::now();
+
+	Grid.QueryBatch(Boxes, Results);
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed batch query time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Results.Handles.size() << " entities found by batch queries" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Found = 0;
+	for(uint32_t i = 0; i < 200000; ++i)
+	{
+		UGridPos Center = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		Grid.QueryCircle(Center, 32.0f, [&](Entity&)
+		{
+			++Found;
+		});
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed circle query time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Found << " entities found by circle queries" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Found = 0;
+	for(uint32_t i = 0; i < 200000; ++i)
+	{
+		UGridPos Point = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		Grid.QueryNearest(Point, 8, [&](Entity&, float)
+		{
+			++Found;
+		});
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed nearest query time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Found << " entities found by nearest queries" << std::endl;
+
+
+	start = std::chrono::high_resolution_clock::now();
+
+	Found = 0;
+	float TotalDistance = 0.0f;
+	for(uint32_t i = 0; i < 1000000; ++i)
+	{
+		UGridPos Origin = { randf(0, GridCells.X * CellDim.W), randf(0, GridCells.Y * CellDim.H) };
+		float Angle = randf(0.0f, 6.2831853f);
+		Grid.Raycast(Origin, { std::cos(Angle), std::sin(Angle) }, 1000.0f, [&](Entity&, float Distance)
+		{
+			++Found;
+			TotalDistance += Distance;
+			return false;
+		});
+	}
+
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << "Elapsed first hit raycast time: " << duration.count() << " milliseconds" << std::endl;
+	std::cout << Found << " rays hit an entity, average distance " << (Found ? TotalDistance / Found : 0.0f) << std::endl;
+
+
+	uint32_t MaxThreads = std::max(1u, std::thread::hardware_concurrency());
+	for(uint32_t ThreadCount = 1; ; ThreadCount = std::min(ThreadCount * 2, MaxThreads))
+	{
+		struct alignas(64) Counter
+		{
+			uint32_t Collisions = 0;
+		};
+		std::vector<Counter> Counters(ThreadCount);
+
+		start = std::chrono::high_resolution_clock::now();
+
+		Grid.Tick([&](uint32_t Thread, Entity&, Entity&)
+		{
+			++Counters[Thread].Collisions;
+		}, ThreadCount);
+
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+		uint32_t Collisions = 0;
+		for(Counter& Count : Counters)
+		{
+			Collisions += Count.Collisions;
+		}
+
+		std::cout << "Elapsed tick time with " << ThreadCount << " threads: " << duration.count() <<
+			" milliseconds (" << Collisions << " registered broad collisions)" << std::endl;
+
+		if(ThreadCount == MaxThreads)
+		{
+			break;
+		}
+	}
 }
@@ -18,11 +18,30 @@
 
 #include <vector>
 #include <memory>
+#include <span>
 #include <cstdint>
+#include <thread>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <type_traits>
+#include <atomic>
+#include <stdexcept>
+#include <cstdlib>
 
-#include <iostream>
+#if defined(__linux__)
+#include <sys/mman.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
 struct UGridPos
@@ -48,6 +67,19 @@ struct UGridEntity
 	UGridPos Pos;
 	UGridDim Dim;
 	uint32_t Copied = 0;
+	uint32_t Handle = 0;
+	uint32_t Sleeping = 0;
+};
+
+/*
+ * Two entities collide only if each one's category is in the other's mask.
+ * Kept next to the entities rather than in them, so that the filter checks
+ * in Tick() read a compact array and the entities stay small.
+ */
+struct UGridFilter
+{
+	uint32_t Category = 1;
+	uint32_t Mask = UINT32_MAX;
 };
 
 struct UGridReference
@@ -56,12 +88,76 @@ struct UGridReference
 	uint32_t Ref;
 };
 
+struct UGridHandle
+{
+	uint32_t Index;
+	uint32_t Generation;
+};
+
+struct UGridHandleSlot
+{
+	uint32_t Entity;
+	uint32_t Generation;
+};
 
-template<typename T>
+/*
+ * A pair of overlapping entities remembered between TickContacts() calls,
+ * with A.Index < B.Index.
+ */
+struct UGridContact
+{
+	UGridHandle A;
+	UGridHandle B;
+
+	bool
+	operator<(
+		const UGridContact& Other
+		) const
+	{
+		if(this->A.Index != Other.A.Index)
+		{
+			return this->A.Index < Other.A.Index;
+		}
+
+		if(this->B.Index != Other.B.Index)
+		{
+			return this->B.Index < Other.B.Index;
+		}
+
+		if(this->A.Generation != Other.A.Generation)
+		{
+			return this->A.Generation < Other.A.Generation;
+		}
+
+		return this->B.Generation < Other.B.Generation;
+	}
+};
+
+struct UGridBox
+{
+	UGridPos Pos;
+	UGridDim Dim;
+};
+
+/*
+ * Results of a batch query in compressed sparse row form, the handles found
+ * by query i are Handles[Offsets[i]] up to Handles[Offsets[i + 1]]. Reusing
+ * one across calls keeps its memory.
+ */
+struct UGridBatchResults
+{
+	std::vector<uint32_t> Offsets;
+	std::vector<UGridHandle> Handles;
+};
+
+
+template<typename T, typename AllocatorType = std::allocator<T>>
 class UGridList
 {
 private:
-	std::allocator<T> Allocator;
+	using Traits = std::allocator_traits<AllocatorType>;
+
+	AllocatorType Allocator;
 	T* List = nullptr;
 	uint32_t Used = 1;
 	uint32_t Size = 1;
@@ -70,51 +166,75 @@ public:
 	UGridList() = default;
 
 	UGridList(
-		const UGridList& Other
-		)
-	{
-		this->Allocator = Other.Allocator;
-		this->Size = std::min(Other.Size, Other.Used * 2);
-		this->List = this->Allocator.allocate(this->Size);
-	}
+		const UGridList&
+		) = delete;
 
-	UGridList<T>&
+	UGridList&
 	operator=(
-		UGridList&& Other
+		const UGridList&
+		) = delete;
+
+	/*
+	 * Empties the list and makes sure it has room for every element of
+	 * Other, reallocating only if it does not. Used with Swap() to build a
+	 * compacted copy of Other in a buffer that is kept around between calls.
+	 */
+	void
+	Prepare(
+		const UGridList& Other
 		)
 	{
-		if(this == &Other)
+		if(!this->List || this->Size < Other.Used)
 		{
-			return *this;
-		}
-
-		this->Allocator.deallocate(this->List, this->Size);
+			if(this->List)
+			{
+				Traits::deallocate(this->Allocator, this->List, this->Size);
+			}
 
-		this->Allocator = Other.Allocator;
-		this->List = Other.List;
-		this->Used = Other.Used;
-		this->Size = Other.Size;
-		this->Free = Other.Free;
+			this->Size = std::min(Other.Size, Other.Used * 2);
+			this->List = Traits::allocate(this->Allocator, this->Size);
+		}
 
-		Other.List = nullptr;
+		this->Used = 1;
+		this->Free = 0;
+	}
 
-		return *this;
+	void
+	Swap(
+		UGridList& Other
+		) noexcept
+	{
+		std::swap(this->Allocator, Other.Allocator);
+		std::swap(this->List, Other.List);
+		std::swap(this->Used, Other.Used);
+		std::swap(this->Size, Other.Size);
+		std::swap(this->Free, Other.Free);
 	}
 
 	~UGridList(
 		)
 	{
-		this->Allocator.deallocate(this->List, this->Size);
+		if(this->List)
+		{
+			Traits::deallocate(this->Allocator, this->List, this->Size);
+		}
 	}
 
 	void
 	SetAllocator(
-		const std::allocator<T>& Allocator
+		const AllocatorType& Allocator
 		) noexcept
 	{
 		this->Allocator = Allocator;
 	}
 
+	const AllocatorType&
+	GetAllocator(
+		) const noexcept
+	{
+		return this->Allocator;
+	}
+
 	T*
 	GetPtr(
 		)
@@ -130,6 +250,33 @@ public:
 		this->Used = End - this->List;
 	}
 
+	void
+	Reserve(
+		uint32_t Size
+		)
+	{
+		if(Size <= this->Size)
+		{
+			return;
+		}
+
+		T* New = Traits::allocate(this->Allocator, Size);
+		if(this->List)
+		{
+			memcpy(New, this->List, sizeof(*this->List) * this->Used);
+			Traits::deallocate(this->Allocator, this->List, this->Size);
+		}
+		this->List = New;
+		this->Size = Size;
+	}
+
+	uint32_t
+	GetUsed(
+		) const noexcept
+	{
+		return this->Used;
+	}
+
 	uint32_t
 	Get(
 		)
@@ -144,11 +291,11 @@ public:
 		if(this->Used == this->Size) [[unlikely]]
 		{
 			this->Size = (this->Size << 1) | 1;
-			T* New = this->Allocator.allocate(this->Size);
+			T* New = Traits::allocate(this->Allocator, this->Size);
 			if(this->List)
 			{
 				memcpy(New, this->List, sizeof(*this->List) * this->Used);
-				this->Allocator.deallocate(this->List, this->Size >> 1);
+				Traits::deallocate(this->Allocator, this->List, this->Size >> 1);
 			}
 			this->List = New;
 		}
@@ -175,203 +322,4142 @@ public:
 };
 
 
-template<typename EntityType, typename = std::enable_if_t<std::is_base_of<UGridEntity, EntityType>::value>>
-class UGrid
+/*
+ * Allocator backing large arrays with 2 MiB pages, for grids whose cell,
+ * entity and reference arrays span enough memory for TLB misses to show.
+ * Explicit huge pages (MAP_HUGETLB) are tried first, and if none are
+ * reserved the mapping falls back to regular pages with transparent huge
+ * pages requested through madvise(). Arrays below one huge page, and every
+ * array on systems without mmap(), come from the default allocator.
+ *
+ * Every mapping starts on a 2 MiB boundary, so arrays walked in lockstep
+ * (entities and filters, cells and references, an array and its spare)
+ * would all land in the same L1 sets. Each array is therefore shifted by
+ * a different number of cache lines within its first 4 KiB.
+ */
+template<typename T>
+class UGridHugePageAllocator
 {
 private:
-	UGridList<EntityType> Entities;
-	UGridList<UGridReference> References;
-
-	std::allocator<uint32_t> CellAllocator;
-	uint32_t* Cells;
-	uint32_t* CellsEnd;
-
-	UGridCell GridCells;
-	UGridDim CellDim;
-	UGridDim InverseCellDim;
+	static constexpr std::size_t PageSize = std::size_t(2) << 20;
+	static constexpr std::size_t ColourRange = 4096;
 
-	UGridCell
-	PosToCell(
-		UGridPos Pos
+	static std::size_t
+	GetMappingSize(
+		std::size_t Count
 		)
 	{
-		uint32_t XCell = std::min(this->GridCells.X - 1,
-			static_cast<uint32_t>(std::max(Pos.X, 0.0f) * this->InverseCellDim.W));
-		uint32_t YCell = std::min(this->GridCells.Y - 1,
-			static_cast<uint32_t>(std::max(Pos.Y, 0.0f) * this->InverseCellDim.H));
-		return { XCell, YCell };
+		return (Count * sizeof(T) + ColourRange + PageSize - 1) & ~(PageSize - 1);
 	}
 
-	void
-	Insert(
-		uint32_t* Cell,
-		uint32_t EntityIndex
+	static std::size_t
+	GetColour(
 		)
 	{
-		uint32_t Index = this->References.Get();
-		this->References[Index].Next = *Cell;
-		this->References[Index].Ref = EntityIndex;
-		*Cell = Index;
+		static std::atomic<uint32_t> Next = 0;
+		return (Next.fetch_add(1, std::memory_order_relaxed) * 5 % (ColourRange / 64)) * 64;
 	}
+public:
+	using value_type = T;
 
-	void
-	Optimize(
-		)
-	{
-		UGridList<EntityType> NewEntities(this->Entities);
-		EntityType* HeadEntity = NewEntities.GetPtr();
-		EntityType* CurrentEntity = HeadEntity + 1;
+	UGridHugePageAllocator() = default;
 
-		UGridList<UGridReference> NewReferences(this->References);
-		UGridReference* HeadReference = NewReferences.GetPtr();
-		UGridReference* CurrentReference = HeadReference + 1;
+	template<typename U>
+	UGridHugePageAllocator(
+		const UGridHugePageAllocator<U>&
+		) noexcept
+	{
+	}
 
-		for(uint32_t* Cell = this->Cells; Cell <= this->CellsEnd; ++Cell)
+	T*
+	allocate(
+		std::size_t Count
+		)
+	{
+#if defined(__linux__)
+		if(Count * sizeof(T) >= PageSize)
 		{
-			bool First = true;
-			uint32_t i = *Cell;
-			while(i)
-			{
-				UGridReference& Reference = this->References[i];
-				i = Reference.Next;
-				EntityType& Entity = this->Entities[Reference.Ref];
+			std::size_t Size = GetMappingSize(Count);
+			/* Without a size the default huge page size is used, which
+			 * need not be the 2 MiB the mapping is rounded to */
+			void* Ptr = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
 
-				if(!Entity.Copied)
+			if(Ptr == MAP_FAILED)
+			{
+				/* Transparent huge pages need a 2 MiB aligned mapping,
+				 * so map one page more and trim the ends */
+				uint8_t* Raw = static_cast<uint8_t*>(mmap(nullptr, Size + PageSize,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+				if(Raw == MAP_FAILED)
 				{
-					*CurrentEntity = Entity;
-					Entity.Copied = CurrentEntity - HeadEntity;
-					++CurrentEntity;
+					throw std::bad_alloc();
 				}
 
-				if(First)
+				uint8_t* Aligned = reinterpret_cast<uint8_t*>(
+					(reinterpret_cast<uintptr_t>(Raw) + PageSize - 1) & ~(PageSize - 1));
+				if(Aligned != Raw)
 				{
-					First = false;
-					*Cell = CurrentReference - HeadReference;
+					munmap(Raw, Aligned - Raw);
 				}
+				munmap(Aligned + Size, Raw + PageSize - Aligned);
 
-				UGridReference* NextReference = CurrentReference + 1;
-				CurrentReference->Next = i ? NextReference - HeadReference : 0;
-				CurrentReference->Ref = Entity.Copied;
-				CurrentReference = NextReference;
+				madvise(Aligned, Size, MADV_HUGEPAGE);
+				Ptr = Aligned;
 			}
+
+			return reinterpret_cast<T*>(static_cast<uint8_t*>(Ptr) + GetColour());
 		}
+#endif
 
-		NewEntities.SetEnd(CurrentEntity);
-		NewReferences.SetEnd(CurrentReference);
+		return std::allocator<T>().allocate(Count);
+	}
+
+	void
+	deallocate(
+		T* Ptr,
+		std::size_t Count
+		) noexcept
+	{
+#if defined(__linux__)
+		if(Count * sizeof(T) >= PageSize)
+		{
+			/* The colour offset never reaches the next 2 MiB boundary. A
+			 * failing unmap means the pointer or count does not belong to
+			 * this allocator, which cannot be reported from here */
+			if(munmap(reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(Ptr) & ~(PageSize - 1)),
+				GetMappingSize(Count)) != 0)
+			{
+				std::abort();
+			}
+			return;
+		}
+#endif
 
-		this->Entities = std::move(NewEntities);
-		this->References = std::move(NewReferences);
+		std::allocator<T>().deallocate(Ptr, Count);
 	}
-public:
-	UGrid(
-		UGridCell GridCells,
-		UGridDim CellDim
-		)
+
+	template<typename U>
+	bool
+	operator==(
+		const UGridHugePageAllocator<U>&
+		) const noexcept
 	{
-		this->GridCells = GridCells;
-		this->CellDim = CellDim;
+		return true;
+	}
+};
 
-		uint32_t CellsNum = GridCells.X * GridCells.Y;
 
-		this->InverseCellDim.W = 1.0f / CellDim.W;
-		this->InverseCellDim.H = 1.0f / CellDim.H;
+/*
+ * Entity storage policies. UGridAoSStorage keeps whole entities in a single
+ * array. UGridSoAStorage additionally keeps positions and half-extents in
+ * separate float arrays, which is all the broad phase and the queries read,
+ * and touches the entities themselves only to hand them to callbacks. Both
+ * keep every entity's category and mask in a compact side array, so that
+ * filtering pairs does not pull whole entities into cache.
+ *
+ * Like UGridList, preparing a storage only makes room for the other
+ * storage's entities without copying them. Allocator is rebound for every
+ * array a storage keeps.
+ */
+template<typename EntityType, typename Allocator = std::allocator<EntityType>>
+class UGridAoSStorage
+{
+private:
+	template<typename T>
+	using List = UGridList<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
 
-		this->Cells = this->CellAllocator.allocate(CellsNum);
-		this->CellsEnd = this->Cells + CellsNum;
+	List<EntityType> Entities;
+	List<UGridFilter> Filters;
+public:
+	void
+	Prepare(
+		const UGridAoSStorage& Other
+		)
+	{
+		this->Entities.Prepare(Other.Entities);
+		this->Filters.Prepare(Other.Filters);
 	}
 
-	UGrid(
-		UGridCell GridCells,
-		UGridDim CellDim,
-		const std::allocator<uint32_t>& CellAllocator
-		)
+	void
+	Swap(
+		UGridAoSStorage& Other
+		) noexcept
 	{
-		this->CellAllocator = CellAllocator;
-		this(GridCells, CellDim);
+		this->Entities.Swap(Other.Entities);
+		this->Filters.Swap(Other.Filters);
 	}
 
 	void
-	SetEntityAllocator(
-		const std::allocator<EntityType>& EntityAllocator
+	SetAllocator(
+		const Allocator& EntityAllocator
 		) noexcept
 	{
 		this->Entities.SetAllocator(EntityAllocator);
+		this->Filters.SetAllocator(EntityAllocator);
+	}
+
+	const Allocator&
+	GetAllocator(
+		) const noexcept
+	{
+		return this->Entities.GetAllocator();
 	}
 
 	void
-	SetReferenceAllocator(
-		const std::allocator<UGridReference>& ReferenceAllocator
-		) noexcept
+	SetUsed(
+		uint32_t Used
+		)
 	{
-		this->References.SetAllocator(ReferenceAllocator);
+		this->Entities.SetEnd(this->Entities.GetPtr() + Used);
+		this->Filters.SetEnd(this->Filters.GetPtr() + Used);
 	}
 
 	void
-	Insert(
-		EntityType Entity
+	Reserve(
+		uint32_t Size
 		)
 	{
-		uint32_t Index = this->Entities.Get();
-		this->Entities[Index] = Entity;
+		this->Entities.Reserve(Size);
+		this->Filters.Reserve(Size);
+	}
 
-		UGridCell Start = this->PosToCell({ Entity.Pos.X - Entity.Dim.W, Entity.Pos.Y - Entity.Dim.H });
-		UGridCell End = this->PosToCell({ Entity.Pos.X + Entity.Dim.W, Entity.Pos.Y + Entity.Dim.H });
+	uint32_t
+	GetUsed(
+		) const noexcept
+	{
+		return this->Entities.GetUsed();
+	}
 
-		for(uint32_t X = Start.X; X <= End.X; ++X)
-		{
-			for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
-			{
-				this->Insert(this->Cells + X * this->GridCells.Y + Y, Index);
-			}
-		}
+	uint32_t
+	Get(
+		)
+	{
+		this->Filters.Get();
+		return this->Entities.Get();
 	}
 
 	void
-	Tick(
-		)
+	Ret(
+		uint32_t Index
+		) noexcept
 	{
-		this->Optimize();
+		this->Entities.Ret(Index);
+		this->Filters.Ret(Index);
+	}
 
-		uint32_t GlobalMaxEntityIndex = 0;
-		uint32_t Collisions = 0;
+	EntityType&
+	operator[](
+		uint32_t Index
+		)
+	{
+		return this->Entities[Index];
+	}
 
-		for(uint32_t* Cell = this->Cells; Cell <= this->CellsEnd; ++Cell)
-		{
-			uint32_t LocalMaxEntityIndex = 0;
+	UGridPos
+	GetPos(
+		uint32_t Index
+		)
+	{
+		return this->Entities[Index].Pos;
+	}
 
-			uint32_t i = *Cell;
-			while(i)
-			{
-				UGridReference& Reference = this->References[i];
-				i = Reference.Next;
-				LocalMaxEntityIndex = std::max(LocalMaxEntityIndex, Reference.Ref);
+	UGridDim
+	GetDim(
+		uint32_t Index
+		)
+	{
+		return this->Entities[Index].Dim;
+	}
 
-				if(Reference.Ref <= GlobalMaxEntityIndex) {
-					continue;
-				}
+	UGridFilter
+	GetFilter(
+		uint32_t Index
+		)
+	{
+		return this->Filters[Index];
+	}
 
-				// std::cout << "Update entity id " << Reference.Ref << std::endl;
+	void
+	Set(
+		uint32_t Index,
+		const EntityType& Entity,
+		UGridFilter Filter
+		)
+	{
+		this->Entities[Index] = Entity;
+		this->Filters[Index] = Filter;
+	}
 
-				uint32_t j = i;
-				while(j)
-				{
-					UGridReference& OtherReference = this->References[j];
-					j = OtherReference.Next;
+	void
+	SetGeometry(
+		uint32_t Index,
+		UGridPos Pos,
+		UGridDim Dim
+		)
+	{
+		this->Entities[Index].Pos = Pos;
+		this->Entities[Index].Dim = Dim;
+	}
 
-					if(OtherReference.Ref < GlobalMaxEntityIndex)
-					{
-						continue;
-					}
+	void
+	SetFilter(
+		uint32_t Index,
+		UGridFilter Filter
+		)
+	{
+		this->Filters[Index] = Filter;
+	}
 
-					++Collisions;
-					// std::cout << "Collision between entity id " << OtherReference.Ref << " and " << Reference.Ref << std::endl;
-				}
+	void
+	Copy(
+		uint32_t Index,
+		UGridAoSStorage& From,
+		uint32_t FromIndex
+		)
+	{
+		this->Entities[Index] = From.Entities[FromIndex];
+		this->Filters[Index] = From.Filters[FromIndex];
+	}
+};
 
-			}
+/*
+ * Pos and Dim of the entities are kept in sync with the float arrays, so that
+ * entities handed out by the grid still read correctly.
+ */
+template<typename EntityType, typename Allocator = std::allocator<EntityType>>
+class UGridSoAStorage
+{
+private:
+	template<typename T>
+	using List = UGridList<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
 
-			GlobalMaxEntityIndex = std::max(GlobalMaxEntityIndex, LocalMaxEntityIndex);
-		}
+	List<EntityType> Entities;
+	List<float> X;
+	List<float> Y;
+	List<float> W;
+	List<float> H;
+	List<UGridFilter> Filters;
+public:
+	void
+	Prepare(
+		const UGridSoAStorage& Other
+		)
+	{
+		this->Entities.Prepare(Other.Entities);
+		this->X.Prepare(Other.X);
+		this->Y.Prepare(Other.Y);
+		this->W.Prepare(Other.W);
+		this->H.Prepare(Other.H);
+		this->Filters.Prepare(Other.Filters);
+	}
 
-		std::cout << Collisions << " registered broad collisions" << std::endl;
+	void
+	Swap(
+		UGridSoAStorage& Other
+		) noexcept
+	{
+		this->Entities.Swap(Other.Entities);
+		this->X.Swap(Other.X);
+		this->Y.Swap(Other.Y);
+		this->W.Swap(Other.W);
+		this->H.Swap(Other.H);
+		this->Filters.Swap(Other.Filters);
+	}
+
+	void
+	SetAllocator(
+		const Allocator& EntityAllocator
+		) noexcept
+	{
+		this->Entities.SetAllocator(EntityAllocator);
+		this->X.SetAllocator(EntityAllocator);
+		this->Y.SetAllocator(EntityAllocator);
+		this->W.SetAllocator(EntityAllocator);
+		this->H.SetAllocator(EntityAllocator);
+		this->Filters.SetAllocator(EntityAllocator);
+	}
+
+	const Allocator&
+	GetAllocator(
+		) const noexcept
+	{
+		return this->Entities.GetAllocator();
+	}
+
+	void
+	SetUsed(
+		uint32_t Used
+		)
+	{
+		this->Entities.SetEnd(this->Entities.GetPtr() + Used);
+		this->X.SetEnd(this->X.GetPtr() + Used);
+		this->Y.SetEnd(this->Y.GetPtr() + Used);
+		this->W.SetEnd(this->W.GetPtr() + Used);
+		this->H.SetEnd(this->H.GetPtr() + Used);
+		this->Filters.SetEnd(this->Filters.GetPtr() + Used);
+	}
+
+	void
+	Reserve(
+		uint32_t Size
+		)
+	{
+		this->Entities.Reserve(Size);
+		this->X.Reserve(Size);
+		this->Y.Reserve(Size);
+		this->W.Reserve(Size);
+		this->H.Reserve(Size);
+		this->Filters.Reserve(Size);
+	}
+
+	uint32_t
+	GetUsed(
+		) const noexcept
+	{
+		return this->Entities.GetUsed();
+	}
+
+	/* All arrays see the same sequence of calls, so their free lists and
+	 * indices stay in lockstep */
+	uint32_t
+	Get(
+		)
+	{
+		this->X.Get();
+		this->Y.Get();
+		this->W.Get();
+		this->H.Get();
+		this->Filters.Get();
+		return this->Entities.Get();
+	}
+
+	void
+	Ret(
+		uint32_t Index
+		) noexcept
+	{
+		this->Entities.Ret(Index);
+		this->X.Ret(Index);
+		this->Y.Ret(Index);
+		this->W.Ret(Index);
+		this->H.Ret(Index);
+		this->Filters.Ret(Index);
+	}
+
+	EntityType&
+	operator[](
+		uint32_t Index
+		)
+	{
+		return this->Entities[Index];
+	}
+
+	UGridPos
+	GetPos(
+		uint32_t Index
+		)
+	{
+		return { this->X[Index], this->Y[Index] };
+	}
+
+	UGridDim
+	GetDim(
+		uint32_t Index
+		)
+	{
+		return { this->W[Index], this->H[Index] };
+	}
+
+	UGridFilter
+	GetFilter(
+		uint32_t Index
+		)
+	{
+		return this->Filters[Index];
+	}
+
+	void
+	Set(
+		uint32_t Index,
+		const EntityType& Entity,
+		UGridFilter Filter
+		)
+	{
+		this->Entities[Index] = Entity;
+		this->X[Index] = Entity.Pos.X;
+		this->Y[Index] = Entity.Pos.Y;
+		this->W[Index] = Entity.Dim.W;
+		this->H[Index] = Entity.Dim.H;
+		this->Filters[Index] = Filter;
+	}
+
+	void
+	SetGeometry(
+		uint32_t Index,
+		UGridPos Pos,
+		UGridDim Dim
+		)
+	{
+		this->Entities[Index].Pos = Pos;
+		this->Entities[Index].Dim = Dim;
+		this->X[Index] = Pos.X;
+		this->Y[Index] = Pos.Y;
+		this->W[Index] = Dim.W;
+		this->H[Index] = Dim.H;
+	}
+
+	void
+	SetFilter(
+		uint32_t Index,
+		UGridFilter Filter
+		)
+	{
+		this->Filters[Index] = Filter;
+	}
+
+	void
+	Copy(
+		uint32_t Index,
+		UGridSoAStorage& From,
+		uint32_t FromIndex
+		)
+	{
+		this->Entities[Index] = From.Entities[FromIndex];
+		this->X[Index] = From.X[FromIndex];
+		this->Y[Index] = From.Y[FromIndex];
+		this->W[Index] = From.W[FromIndex];
+		this->H[Index] = From.H[FromIndex];
+		this->Filters[Index] = From.Filters[FromIndex];
+	}
+};
+
+
+/*
+ * Cell policies, mapping cell coordinates to the heads of the cells' lists.
+ * UGridDenseCells allocates a head for every one of GridCells up front and
+ * clamps positions outside the grid into its border cells. UGridHashedCells
+ * ignores GridCells and keeps only occupied cells, in an open addressing
+ * hash table keyed by their coordinates, so memory follows the number of
+ * occupied cells and the world need not be bounded. Its coordinates are
+ * biased by 2^31, putting the origin in the middle of the unsigned range so
+ * that cell order still follows position and the border cells are too far
+ * out to matter.
+ *
+ * Heads live in an array of GetSlots() slots, unoccupied slots being 0, and
+ * a slot stays put until a cell is added or released. ForEach() visits the
+ * occupied cells of a range of columns in X-major order; for hashed cells
+ * that order is built by Sort(), which must follow the last change.
+ */
+template<typename Allocator>
+class UGridDenseCells
+{
+private:
+	using Traits = std::allocator_traits<Allocator>;
+	using OccupancyAllocator = typename Traits::template rebind_alloc<uint64_t>;
+	using OccupancyTraits = std::allocator_traits<OccupancyAllocator>;
+
+	Allocator HeadAllocator;
+	OccupancyAllocator BitAllocator;
+	UGridCell GridCells;
+	uint32_t* Heads;
+	uint32_t Slots;
+
+	/*
+	 * One bit per cell, set while its list is not empty, so that loops over
+	 * the whole grid only visit occupied cells.
+	 */
+	uint64_t* Occupied;
+	uint32_t OccupiedWords;
+public:
+	static constexpr bool Bounded = true;
+
+	UGridDenseCells(
+		UGridCell GridCells,
+		const Allocator& HeadAllocator
+		) : HeadAllocator(HeadAllocator), BitAllocator(HeadAllocator), GridCells(GridCells)
+	{
+		this->Slots = GridCells.X * GridCells.Y;
+		this->Heads = Traits::allocate(this->HeadAllocator, this->Slots);
+		memset(this->Heads, 0, sizeof(*this->Heads) * this->Slots);
+
+		this->OccupiedWords = (this->Slots + 63) / 64;
+		this->Occupied = OccupancyTraits::allocate(this->BitAllocator, this->OccupiedWords);
+		memset(this->Occupied, 0, sizeof(*this->Occupied) * this->OccupiedWords);
+	}
+
+	UGridDenseCells(
+		const UGridDenseCells&
+		) = delete;
+
+	UGridDenseCells&
+	operator=(
+		const UGridDenseCells&
+		) = delete;
+
+	~UGridDenseCells(
+		)
+	{
+		Traits::deallocate(this->HeadAllocator, this->Heads, this->Slots);
+		OccupancyTraits::deallocate(this->BitAllocator, this->Occupied, this->OccupiedWords);
+	}
+
+	const Allocator&
+	GetAllocator(
+		) const noexcept
+	{
+		return this->HeadAllocator;
+	}
+
+	/*
+	 * Cell of a position given in units of cells.
+	 */
+	UGridCell
+	ToCell(
+		float X,
+		float Y
+		)
+	{
+		return {
+			std::min(this->GridCells.X - 1, static_cast<uint32_t>(std::max(X, 0.0f))),
+			std::min(this->GridCells.Y - 1, static_cast<uint32_t>(std::max(Y, 0.0f)))
+		};
+	}
+
+	/*
+	 * The cell whose corner is at position 0, 0.
+	 */
+	UGridCell
+	GetOrigin(
+		)
+	{
+		return { 0, 0 };
+	}
+
+	/*
+	 * The cell ToCell() clamps to at the far end, the last that exists.
+	 */
+	UGridCell
+	GetLast(
+		)
+	{
+		return { this->GridCells.X - 1, this->GridCells.Y - 1 };
+	}
+
+	/*
+	 * Bounds that every occupied cell lies within.
+	 */
+	UGridCell
+	GetMin(
+		)
+	{
+		return { 0, 0 };
+	}
+
+	UGridCell
+	GetMax(
+		)
+	{
+		return this->GetLast();
+	}
+
+	uint32_t*
+	Get(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return this->Heads + X * this->GridCells.Y + Y;
+	}
+
+	uint32_t
+	Find(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return this->Heads[X * this->GridCells.Y + Y];
+	}
+
+	/*
+	 * Called once the list at Head is no longer empty, and once it is again.
+	 */
+	void
+	Occupy(
+		uint32_t* Head
+		)
+	{
+		uint32_t Cell = Head - this->Heads;
+		this->Occupied[Cell / 64] |= uint64_t(1) << (Cell % 64);
+	}
+
+	void
+	Release(
+		uint32_t* Head
+		)
+	{
+		uint32_t Cell = Head - this->Heads;
+		this->Occupied[Cell / 64] &= ~(uint64_t(1) << (Cell % 64));
+	}
+
+	uint32_t*
+	GetHeads(
+		)
+	{
+		return this->Heads;
+	}
+
+	uint32_t
+	GetSlots(
+		)
+	{
+		return this->Slots;
+	}
+
+	void
+	Reserve(
+		uint32_t
+		)
+	{
+	}
+
+	void
+	Sort(
+		)
+	{
+	}
+
+	/*
+	 * Calls Visit(Cell, Head) for every occupied cell of the columns
+	 * [XBegin, XEnd). Empty cells cost a bit each and runs of 64 of them a
+	 * single word test.
+	 */
+	template<typename Fn>
+	void
+	ForEach(
+		uint32_t XBegin,
+		uint32_t XEnd,
+		Fn&& Visit
+		)
+	{
+		uint32_t Begin = XBegin * this->GridCells.Y;
+		uint32_t End = XEnd * this->GridCells.Y;
+		if(Begin >= End)
+		{
+			return;
+		}
+
+		uint32_t Word = Begin / 64;
+		uint32_t LastWord = (End - 1) / 64;
+		uint64_t Bits = this->Occupied[Word] & (~uint64_t(0) << (Begin % 64));
+
+		while(true)
+		{
+			if(Word == LastWord)
+			{
+				Bits &= ~uint64_t(0) >> (63 - (End - 1) % 64);
+			}
+
+			while(Bits)
+			{
+				uint32_t Cell = Word * 64 + __builtin_ctzll(Bits);
+				uint32_t X = Cell / this->GridCells.Y;
+				Visit(UGridCell{ X, Cell - X * this->GridCells.Y }, this->Heads[Cell]);
+				Bits &= Bits - 1;
+			}
+
+			if(Word == LastWord)
+			{
+				return;
+			}
+
+			Bits = this->Occupied[++Word];
+		}
+	}
+};
+
+template<typename Allocator>
+class UGridHashedCells
+{
+private:
+	using Traits = std::allocator_traits<Allocator>;
+	using KeyAllocator = typename Traits::template rebind_alloc<uint64_t>;
+	using KeyTraits = std::allocator_traits<KeyAllocator>;
+	using OrderList = std::vector<std::pair<uint64_t, uint32_t>,
+		typename Traits::template rebind_alloc<std::pair<uint64_t, uint32_t>>>;
+
+	static constexpr uint32_t Bias = 0x80000000;
+	static constexpr uint32_t Far = 0xFFFFFF80;
+	static constexpr uint64_t EmptyKey = UINT64_MAX;
+
+	Allocator HeadAllocator;
+	KeyAllocator KeysAllocator;
+	uint64_t* Keys = nullptr;
+	uint32_t* Heads = nullptr;
+	uint32_t Slots = 0;
+	uint32_t Used = 0;
+
+	/*
+	 * Occupied cells as key and slot, sorted by key, and their bounds. The
+	 * bounds only grow until the next Sort().
+	 */
+	OrderList Order;
+	OrderList SortBuffer;
+	bool Sorted = true;
+	UGridCell Min = { UINT32_MAX, UINT32_MAX };
+	UGridCell Max = { 0, 0 };
+
+	static uint64_t
+	GetKey(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return (uint64_t(X) << 32) | Y;
+	}
+
+	uint32_t
+	GetHome(
+		uint64_t Key
+		)
+	{
+		return uint32_t((Key * 0x9E3779B97F4A7C15) >> 32) & (this->Slots - 1);
+	}
+
+	/*
+	 * Slot holding Key, or the empty slot where it would go.
+	 */
+	uint32_t
+	Probe(
+		uint64_t Key
+		)
+	{
+		uint32_t Slot = this->GetHome(Key);
+		while(this->Keys[Slot] != Key && this->Keys[Slot] != EmptyKey)
+		{
+			Slot = (Slot + 1) & (this->Slots - 1);
+		}
+
+		return Slot;
+	}
+
+	void
+	Rehash(
+		uint32_t NewSlots
+		)
+	{
+		uint64_t* OldKeys = this->Keys;
+		uint32_t* OldHeads = this->Heads;
+		uint32_t OldSlots = this->Slots;
+
+		this->Slots = NewSlots;
+		this->Keys = KeyTraits::allocate(this->KeysAllocator, NewSlots);
+		this->Heads = Traits::allocate(this->HeadAllocator, NewSlots);
+		std::fill(this->Keys, this->Keys + NewSlots, EmptyKey);
+		memset(this->Heads, 0, sizeof(*this->Heads) * NewSlots);
+
+		for(uint32_t Slot = 0; Slot < OldSlots; ++Slot)
+		{
+			if(OldKeys[Slot] != EmptyKey)
+			{
+				uint32_t NewSlot = this->Probe(OldKeys[Slot]);
+				this->Keys[NewSlot] = OldKeys[Slot];
+				this->Heads[NewSlot] = OldHeads[Slot];
+			}
+		}
+
+		if(OldKeys)
+		{
+			KeyTraits::deallocate(this->KeysAllocator, OldKeys, OldSlots);
+			Traits::deallocate(this->HeadAllocator, OldHeads, OldSlots);
+		}
+
+		this->Sorted = false;
+	}
+public:
+	static constexpr bool Bounded = false;
+
+	UGridHashedCells(
+		UGridCell,
+		const Allocator& HeadAllocator
+		) : HeadAllocator(HeadAllocator), KeysAllocator(HeadAllocator),
+			Order(HeadAllocator), SortBuffer(HeadAllocator)
+	{
+		this->Rehash(64);
+	}
+
+	UGridHashedCells(
+		const UGridHashedCells&
+		) = delete;
+
+	UGridHashedCells&
+	operator=(
+		const UGridHashedCells&
+		) = delete;
+
+	~UGridHashedCells(
+		)
+	{
+		KeyTraits::deallocate(this->KeysAllocator, this->Keys, this->Slots);
+		Traits::deallocate(this->HeadAllocator, this->Heads, this->Slots);
+	}
+
+	const Allocator&
+	GetAllocator(
+		) const noexcept
+	{
+		return this->HeadAllocator;
+	}
+
+	UGridCell
+	ToCell(
+		float X,
+		float Y
+		)
+	{
+		return {
+			static_cast<uint32_t>(static_cast<int64_t>(std::clamp(std::floor(X), -0x1p31f, 0x1.fffffep30f)) + Bias),
+			static_cast<uint32_t>(static_cast<int64_t>(std::clamp(std::floor(Y), -0x1p31f, 0x1.fffffep30f)) + Bias)
+		};
+	}
+
+	UGridCell
+	GetOrigin(
+		)
+	{
+		return { Bias, Bias };
+	}
+
+	UGridCell
+	GetLast(
+		)
+	{
+		return { Far, Far };
+	}
+
+	UGridCell
+	GetMin(
+		)
+	{
+		return this->Min;
+	}
+
+	UGridCell
+	GetMax(
+		)
+	{
+		return this->Max;
+	}
+
+	/*
+	 * Head of a cell, adding the cell if it is not there yet. Adding a cell
+	 * may move every other one to another slot.
+	 */
+	uint32_t*
+	Get(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		uint64_t Key = GetKey(X, Y);
+		uint32_t Slot = this->Probe(Key);
+		if(this->Keys[Slot] == Key)
+		{
+			return this->Heads + Slot;
+		}
+
+		if((this->Used + 1) * 2 > this->Slots)
+		{
+			this->Rehash(this->Slots * 2);
+			Slot = this->Probe(Key);
+		}
+
+		this->Keys[Slot] = Key;
+		++this->Used;
+		this->Sorted = false;
+
+		this->Min = { std::min(this->Min.X, X), std::min(this->Min.Y, Y) };
+		this->Max = { std::max(this->Max.X, X), std::max(this->Max.Y, Y) };
+
+		return this->Heads + Slot;
+	}
+
+	uint32_t
+	Find(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return this->Heads[this->Probe(GetKey(X, Y))];
+	}
+
+	void
+	Occupy(
+		uint32_t*
+		)
+	{
+	}
+
+	/*
+	 * Removes the cell, closing the gap in its probe sequence by moving
+	 * later entries back rather than leaving a tombstone.
+	 */
+	void
+	Release(
+		uint32_t* Head
+		)
+	{
+		uint32_t Mask = this->Slots - 1;
+		uint32_t Hole = Head - this->Heads;
+
+		for(uint32_t Slot = (Hole + 1) & Mask; this->Keys[Slot] != EmptyKey; Slot = (Slot + 1) & Mask)
+		{
+			uint32_t Home = this->GetHome(this->Keys[Slot]);
+			if(((Slot - Home) & Mask) >= ((Slot - Hole) & Mask))
+			{
+				this->Keys[Hole] = this->Keys[Slot];
+				this->Heads[Hole] = this->Heads[Slot];
+				Hole = Slot;
+			}
+		}
+
+		this->Keys[Hole] = EmptyKey;
+		this->Heads[Hole] = 0;
+		--this->Used;
+		this->Sorted = false;
+	}
+
+	uint32_t*
+	GetHeads(
+		)
+	{
+		return this->Heads;
+	}
+
+	uint32_t
+	GetSlots(
+		)
+	{
+		return this->Slots;
+	}
+
+	/*
+	 * Makes room for Count more cells, so that adding them moves no slot.
+	 */
+	void
+	Reserve(
+		uint32_t Count
+		)
+	{
+		uint32_t NewSlots = this->Slots;
+		while(uint64_t(this->Used + Count) * 2 > NewSlots)
+		{
+			NewSlots *= 2;
+		}
+
+		if(NewSlots != this->Slots)
+		{
+			this->Rehash(NewSlots);
+		}
+	}
+
+	void
+	Sort(
+		)
+	{
+		if(this->Sorted)
+		{
+			return;
+		}
+
+		/* Every slot is written but only occupied ones are kept, which
+		 * saves a mispredicted branch per slot */
+		this->Order.resize(this->Used + 1);
+		uint32_t Count = 0;
+		for(uint32_t Slot = 0; Slot < this->Slots; ++Slot)
+		{
+			uint64_t Key = this->Keys[Slot];
+			this->Order[Count] = { Key, Slot };
+			Count += Key != EmptyKey;
+		}
+		this->Order.resize(Count);
+
+		this->Min = { UINT32_MAX, UINT32_MAX };
+		this->Max = { 0, 0 };
+		for(const auto& Entry : this->Order)
+		{
+			this->Min = { std::min(this->Min.X, uint32_t(Entry.first >> 32)), std::min(this->Min.Y, uint32_t(Entry.first)) };
+			this->Max = { std::max(this->Max.X, uint32_t(Entry.first >> 32)), std::max(this->Max.Y, uint32_t(Entry.first)) };
+		}
+
+		this->Sorted = true;
+		if(this->Order.empty())
+		{
+			return;
+		}
+
+		/*
+		 * Radix sort, least significant digit first, on the coordinates
+		 * relative to the bounds, which for a world of a few thousand cells
+		 * across takes two passes.
+		 */
+		auto GetWidth = [](uint32_t Value)
+		{
+			return Value ? 32 - __builtin_clz(Value) : 0;
+		};
+
+		constexpr uint32_t DigitBits = 11;
+		uint32_t WidthY = GetWidth(this->Max.Y - this->Min.Y);
+		uint32_t Width = GetWidth(this->Max.X - this->Min.X) + WidthY;
+		UGridCell Low = this->Min;
+
+		auto GetDigit = [&](uint64_t Key, uint32_t Shift)
+		{
+			uint64_t Relative = (uint64_t((Key >> 32) - Low.X) << WidthY) | (uint32_t(Key) - Low.Y);
+			return uint32_t(Relative >> Shift) & ((1 << DigitBits) - 1);
+		};
+
+		this->SortBuffer.resize(this->Order.size());
+		for(uint32_t Shift = 0; Shift < Width; Shift += DigitBits)
+		{
+			uint32_t Offsets[(1 << DigitBits) + 1] = {};
+			for(const auto& Entry : this->Order)
+			{
+				++Offsets[GetDigit(Entry.first, Shift) + 1];
+			}
+
+			for(uint32_t Digit = 0; Digit < (1 << DigitBits); ++Digit)
+			{
+				Offsets[Digit + 1] += Offsets[Digit];
+			}
+
+			for(const auto& Entry : this->Order)
+			{
+				this->SortBuffer[Offsets[GetDigit(Entry.first, Shift)]++] = Entry;
+			}
+
+			this->Order.swap(this->SortBuffer);
+		}
+	}
+
+	template<typename Fn>
+	void
+	ForEach(
+		uint32_t XBegin,
+		uint32_t XEnd,
+		Fn&& Visit
+		)
+	{
+		auto Next = std::lower_bound(this->Order.begin(), this->Order.end(), std::make_pair(GetKey(XBegin, 0), 0u));
+		for(; Next != this->Order.end() && (Next->first >> 32) < XEnd; ++Next)
+		{
+			Visit(UGridCell{ uint32_t(Next->first >> 32), uint32_t(Next->first) }, this->Heads[Next->second]);
+		}
+	}
+};
+
+
+/*
+ * Allocator is used for every array of the grid, rebound to what it holds.
+ * CellStorage is one of the cell policies, dense cells by default. Each
+ * layer, meaning the dynamic and the static entities of every level, holds
+ * fewer than 2^27 entities, inserting past that throws std::length_error.
+ */
+template<
+	typename EntityType,
+	template<typename, typename> class Storage = UGridAoSStorage,
+	typename Allocator = std::allocator<EntityType>,
+	template<typename> class CellStorage = UGridDenseCells
+	>
+class UGrid
+{
+	static_assert(std::is_base_of<UGridEntity, EntityType>::value);
+private:
+	template<typename T>
+	using RebindAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+	using EntityStorage = Storage<EntityType, Allocator>;
+	using ReferenceList = UGridList<UGridReference, RebindAllocator<UGridReference>>;
+	using HandleList = UGridList<UGridHandleSlot, RebindAllocator<UGridHandleSlot>>;
+	using CellAllocatorType = RebindAllocator<uint32_t>;
+	using CellStorageType = CellStorage<CellAllocatorType>;
+
+	/*
+	 * Arrays built while ticking, querying and inserting come from the
+	 * grid's allocator as well, through the cell allocator.
+	 */
+	template<typename T>
+	using ScratchList = std::vector<T, RebindAllocator<T>>;
+	using WakeList = ScratchList<uint32_t>;
+	using ContactList = ScratchList<UGridContact>;
+
+	EntityStorage Entities;
+	ReferenceList References;
+	HandleList OwnHandles;
+
+	/*
+	 * Optimize() builds the new layout in these and swaps them with the
+	 * current arrays, so the arrays are reused from tick to tick.
+	 */
+	EntityStorage SpareEntities;
+	ReferenceList SpareReferences;
+
+	/*
+	 * The static layer is a grid of its own that shares the handles of the
+	 * grid owning it. Its handle slots have StaticBit set in their entity
+	 * index, which LayerBit holds for the layer itself and is 0 otherwise.
+	 * Coarser levels are grids of their own as well, both of the grid and of
+	 * its static layer, with their level in the bits from LevelShift up. That
+	 * leaves IndexMask for the entity index in every layer.
+	 */
+	static constexpr uint32_t StaticBit = 0x80000000;
+	static constexpr uint32_t LevelShift = 27;
+	static constexpr uint32_t MaxLevels = 16;
+	static constexpr uint32_t LevelMask = (MaxLevels - 1) << LevelShift;
+	static constexpr uint32_t IndexMask = (1u << LevelShift) - 1;
+
+	HandleList& Handles;
+	uint32_t LayerBit;
+	std::unique_ptr<UGrid> Static;
+	uint32_t LevelCount = 1;
+	std::vector<std::unique_ptr<UGrid>> Levels;
+
+	/*
+	 * In loose mode an entity is only in the cell containing its Pos and
+	 * LooseDim bounds how far its box reaches out of it, 0 otherwise.
+	 */
+	bool Loose = false;
+	UGridDim LooseDim = { 0.0f, 0.0f };
+	uint32_t StaticChanges = 0;
+	WakeList Wakes;
+
+	ContactList Contacts;
+	ContactList NewContacts;
+
+	CellStorageType Cells;
+
+	UGridCell GridCells;
+	UGridDim CellDim;
+	UGridDim InverseCellDim;
+
+	UGrid(
+		UGridCell GridCells,
+		UGridDim CellDim,
+		const CellAllocatorType& CellAllocator,
+		HandleList& Handles,
+		uint32_t LayerBit
+		) : Handles(Handles), LayerBit(LayerBit), Wakes(CellAllocator),
+			Contacts(CellAllocator), NewContacts(CellAllocator), Cells(GridCells, CellAllocator)
+	{
+		this->GridCells = GridCells;
+		this->CellDim = CellDim;
+
+		this->InverseCellDim.W = 1.0f / CellDim.W;
+		this->InverseCellDim.H = 1.0f / CellDim.H;
+	}
+
+	UGrid&
+	GetStatic(
+		)
+	{
+		if(!this->Static)
+		{
+			this->Static.reset(new UGrid(this->GridCells, this->CellDim, this->Cells.GetAllocator(), this->Handles, StaticBit));
+			this->Static->SetEntityAllocator(this->Entities.GetAllocator());
+			this->Static->SetReferenceAllocator(this->References.GetAllocator());
+			this->Static->LevelCount = this->LevelCount;
+			this->Static->Loose = this->Loose;
+			this->Static->LooseDim = this->LooseDim;
+		}
+
+		return *this->Static;
+	}
+
+	/*
+	 * This grid for level 0, otherwise its coarser level Level, whose cells
+	 * are 2^Level times the size. Levels are created when first needed,
+	 * together with the ones below them.
+	 */
+	UGrid&
+	GetLevelGrid(
+		uint32_t Level
+		)
+	{
+		while(this->Levels.size() < Level)
+		{
+			uint32_t Next = this->Levels.size() + 1;
+			uint64_t Scale = uint64_t(1) << Next;
+			UGridCell LevelCells = {
+				uint32_t((this->GridCells.X + Scale - 1) >> Next),
+				uint32_t((this->GridCells.Y + Scale - 1) >> Next)
+			};
+			UGridDim LevelDim = { this->CellDim.W * Scale, this->CellDim.H * Scale };
+
+			this->Levels.emplace_back(new UGrid(LevelCells, LevelDim, this->Cells.GetAllocator(), this->Handles, this->LayerBit | (Next << LevelShift)));
+			this->Levels.back()->SetEntityAllocator(this->Entities.GetAllocator());
+			this->Levels.back()->SetReferenceAllocator(this->References.GetAllocator());
+			this->Levels.back()->Loose = this->Loose;
+			this->Levels.back()->LooseDim = { this->LooseDim.W * Scale, this->LooseDim.H * Scale };
+		}
+
+		return Level ? *this->Levels[Level - 1] : *this;
+	}
+
+	/*
+	 * Same level of the static layer, or null if there is none.
+	 */
+	UGrid*
+	GetStaticLevel(
+		uint32_t Level
+		)
+	{
+		if(!this->Static || Level > this->Static->Levels.size())
+		{
+			return nullptr;
+		}
+
+		return &this->Static->GetLevelGrid(Level);
+	}
+
+	/*
+	 * First level whose cells are at least as large as a box with
+	 * half-extents Dim, which puts the box in at most four cells, and in
+	 * loose mode whose bound the box fits. Boxes too large for the last
+	 * level go there anyway.
+	 */
+	uint32_t
+	GetLevelFor(
+		UGridDim Dim
+		)
+	{
+		float Size = 2.0f * std::max(Dim.W * this->InverseCellDim.W, Dim.H * this->InverseCellDim.H);
+
+		uint32_t Level = 0;
+		while(
+			Level + 1 < this->LevelCount && (Size > float(1u << Level) ||
+			(this->Loose && (Dim.W > this->LooseDim.W * float(1u << Level) || Dim.H > this->LooseDim.H * float(1u << Level))))
+			)
+		{
+			++Level;
+		}
+
+		return Level;
+	}
+
+	/*
+	 * Whether a handle refers to an entity in this grid's static layer.
+	 */
+	bool
+	IsStatic(
+		UGridHandle Handle
+		)
+	{
+		return this->Static && (this->Handles[Handle.Index].Entity & StaticBit);
+	}
+
+	uint32_t
+	GetIndex(
+		UGridHandle Handle
+		)
+	{
+		return this->Handles[Handle.Index].Entity & IndexMask;
+	}
+
+	uint32_t
+	GetLevelOf(
+		UGridHandle Handle
+		)
+	{
+		return (this->Handles[Handle.Index].Entity & LevelMask) >> LevelShift;
+	}
+
+	/*
+	 * Grid holding the entity behind a handle that is not in the static
+	 * layer, this one or one of its coarser levels.
+	 */
+	UGrid&
+	GetLayer(
+		UGridHandle Handle
+		)
+	{
+		uint32_t Level = this->GetLevelOf(Handle);
+		if(!Level || (this->LayerBit & LevelMask))
+		{
+			return *this;
+		}
+
+		return *this->Levels[Level - 1];
+	}
+
+	/*
+	 * Entity by index, tagged with the LayerBit of the layer it is in.
+	 */
+	EntityType&
+	GetEntity(
+		uint32_t Index
+		)
+	{
+		UGrid& Base = (Index & StaticBit) ? *this->Static : *this;
+		uint32_t Level = (Index & LevelMask) >> LevelShift;
+		UGrid& Layer = Level ? *Base.Levels[Level - 1] : Base;
+
+		return Layer.Entities[Index & IndexMask];
+	}
+
+	/*
+	 * Calls Visit for this grid, its coarser levels and those of its static
+	 * layer.
+	 */
+	template<typename Fn>
+	void
+	ForEachLayer(
+		Fn&& Visit
+		)
+	{
+		Visit(*this);
+
+		for(std::unique_ptr<UGrid>& Level : this->Levels)
+		{
+			Visit(*Level);
+		}
+
+		if(this->Static)
+		{
+			this->Static->ForEachLayer(Visit);
+		}
+	}
+
+	UGridCell
+	PosToCell(
+		UGridPos Pos
+		)
+	{
+		return this->Cells.ToCell(Pos.X * this->InverseCellDim.W, Pos.Y * this->InverseCellDim.H);
+	}
+
+	/*
+	 * Position of the left edge of column X or the top edge of row Y.
+	 */
+	float
+	GetColumnStart(
+		int64_t X
+		)
+	{
+		return static_cast<float>(X - this->Cells.GetOrigin().X) * this->CellDim.W;
+	}
+
+	float
+	GetRowStart(
+		int64_t Y
+		)
+	{
+		return static_cast<float>(Y - this->Cells.GetOrigin().Y) * this->CellDim.H;
+	}
+
+	/*
+	 * Sort key of a cell, X-major like the order Optimize() lays out.
+	 */
+	static uint64_t
+	GetCellKey(
+		UGridCell Cell
+		)
+	{
+		return (uint64_t(Cell.X) << 32) | Cell.Y;
+	}
+
+	/*
+	 * First and last cell an entity is in, the same one in loose mode.
+	 */
+	UGridCell
+	GetStart(
+		uint32_t Index
+		)
+	{
+		UGridPos Pos = this->Entities.GetPos(Index);
+		if(this->Loose)
+		{
+			return this->PosToCell(Pos);
+		}
+
+		UGridDim Dim = this->Entities.GetDim(Index);
+		return this->PosToCell({ Pos.X - Dim.W, Pos.Y - Dim.H });
+	}
+
+	UGridCell
+	GetEnd(
+		uint32_t Index
+		)
+	{
+		UGridPos Pos = this->Entities.GetPos(Index);
+		if(this->Loose)
+		{
+			return this->PosToCell(Pos);
+		}
+
+		UGridDim Dim = this->Entities.GetDim(Index);
+		return this->PosToCell({ Pos.X + Dim.W, Pos.Y + Dim.H });
+	}
+
+	/*
+	 * Number of cells on either side of a cell that a distance of Dim
+	 * reaches into, for the boxes of loose cells.
+	 */
+	UGridCell
+	GetReach(
+		UGridDim Dim
+		)
+	{
+		return {
+			uint32_t(std::ceil(Dim.W * this->InverseCellDim.W)),
+			uint32_t(std::ceil(Dim.H * this->InverseCellDim.H))
+		};
+	}
+
+	static bool
+	Contains(
+		UGridCell Start,
+		UGridCell End,
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return X >= Start.X && X <= End.X && Y >= Start.Y && Y <= End.Y;
+	}
+
+	/*
+	 * Head of a cell's list, GetCell() adding the cell if the cell storage
+	 * keeps only occupied ones.
+	 */
+	uint32_t*
+	GetCell(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return this->Cells.Get(X, Y);
+	}
+
+	uint32_t
+	GetHead(
+		uint32_t X,
+		uint32_t Y
+		)
+	{
+		return this->Cells.Find(X, Y);
+	}
+
+	static bool
+	Overlaps(
+		UGridPos PosA,
+		UGridDim DimA,
+		UGridPos PosB,
+		UGridDim DimB
+		)
+	{
+		return
+			std::abs(PosA.X - PosB.X) <= DimA.W + DimB.W &&
+			std::abs(PosA.Y - PosB.Y) <= DimA.H + DimB.H;
+	}
+
+	static bool
+	Collides(
+		UGridFilter A,
+		UGridFilter B
+		)
+	{
+		return (A.Category & B.Mask) && (B.Category & A.Mask);
+	}
+
+	/*
+	 * Squared distance from a point to a box, 0 if the point is inside.
+	 */
+	static float
+	GetDistanceSquared(
+		UGridPos Pos,
+		UGridDim Dim,
+		UGridPos Point
+		)
+	{
+		float DX = std::max(std::abs(Pos.X - Point.X) - Dim.W, 0.0f);
+		float DY = std::max(std::abs(Pos.Y - Point.Y) - Dim.H, 0.0f);
+		return DX * DX + DY * DY;
+	}
+
+	static bool
+	OverlapsCircle(
+		UGridPos Pos,
+		UGridDim Dim,
+		UGridPos Center,
+		float Radius
+		)
+	{
+		return GetDistanceSquared(Pos, Dim, Center) <= Radius * Radius;
+	}
+
+	/*
+	 * Slab test of a ray against a box. On a hit, Distance is the ray
+	 * parameter where the ray enters the box, or 0 if it starts inside.
+	 */
+	static bool
+	IntersectsRay(
+		UGridPos Pos,
+		UGridDim Dim,
+		UGridPos Origin,
+		UGridPos Direction,
+		float& Distance
+		)
+	{
+		float TMin = 0.0f;
+		float TMax = INFINITY;
+
+		if(Direction.X != 0.0f)
+		{
+			float T1 = (Pos.X - Dim.W - Origin.X) / Direction.X;
+			float T2 = (Pos.X + Dim.W - Origin.X) / Direction.X;
+			TMin = std::max(TMin, std::min(T1, T2));
+			TMax = std::min(TMax, std::max(T1, T2));
+		}
+		else if(std::abs(Origin.X - Pos.X) > Dim.W)
+		{
+			return false;
+		}
+
+		if(Direction.Y != 0.0f)
+		{
+			float T1 = (Pos.Y - Dim.H - Origin.Y) / Direction.Y;
+			float T2 = (Pos.Y + Dim.H - Origin.Y) / Direction.Y;
+			TMin = std::max(TMin, std::min(T1, T2));
+			TMax = std::min(TMax, std::max(T1, T2));
+		}
+		else if(std::abs(Origin.Y - Pos.Y) > Dim.H)
+		{
+			return false;
+		}
+
+		Distance = TMin;
+		return TMin <= TMax;
+	}
+
+	/*
+	 * Ray parameter at which a ray leaves column X or row Y of cells, or
+	 * infinity if it never does. Border cells extend to infinity like
+	 * PosToCell() does.
+	 */
+	float
+	GetColumnExit(
+		uint32_t X,
+		float Origin,
+		float Direction
+		)
+	{
+		if(Direction > 0.0f && X < this->Cells.GetLast().X)
+		{
+			return (this->GetColumnStart(int64_t(X) + 1) - Origin) / Direction;
+		}
+
+		if(Direction < 0.0f && X > 0)
+		{
+			return (this->GetColumnStart(X) - Origin) / Direction;
+		}
+
+		return INFINITY;
+	}
+
+	float
+	GetRowExit(
+		uint32_t Y,
+		float Origin,
+		float Direction
+		)
+	{
+		if(Direction > 0.0f && Y < this->Cells.GetLast().Y)
+		{
+			return (this->GetRowStart(int64_t(Y) + 1) - Origin) / Direction;
+		}
+
+		if(Direction < 0.0f && Y > 0)
+		{
+			return (this->GetRowStart(Y) - Origin) / Direction;
+		}
+
+		return INFINITY;
+	}
+
+	/*
+	 * Distances from a coordinate to a column or a row of cells. Border cells
+	 * extend to infinity like PosToCell() does.
+	 */
+	float
+	GetColumnDistance(
+		uint32_t X,
+		float Coordinate
+		)
+	{
+		float Left = this->GetColumnStart(X);
+		float Right = Left + this->CellDim.W;
+		float Distance = std::max(X ? Left - Coordinate : 0.0f, 0.0f);
+		return std::max(X != this->Cells.GetLast().X ? Coordinate - Right : 0.0f, Distance);
+	}
+
+	float
+	GetRowDistance(
+		uint32_t Y,
+		float Coordinate
+		)
+	{
+		float Top = this->GetRowStart(Y);
+		float Bottom = Top + this->CellDim.H;
+		float Distance = std::max(Y ? Top - Coordinate : 0.0f, 0.0f);
+		return std::max(Y != this->Cells.GetLast().Y ? Coordinate - Bottom : 0.0f, Distance);
+	}
+
+	/*
+	 * Squared radius a cell has to be within to be visited by a circle query.
+	 * It is padded a little so that rounding never drops a cell that
+	 * PosToCell() maps a point of the circle to.
+	 */
+	float
+	GetCellRadiusSquared(
+		float Radius
+		)
+	{
+		float Padded = Radius + std::max(this->CellDim.W, this->CellDim.H) * 0x1p-12f;
+		return Padded * Padded;
+	}
+
+	bool
+	IsCellOutsideCircle(
+		uint32_t X,
+		uint32_t Y,
+		UGridPos Center,
+		float RadiusSquared
+		)
+	{
+		float DX = this->GetColumnDistance(X, Center.X);
+		float DY = this->GetRowDistance(Y, Center.Y);
+		return DX * DX + DY * DY > RadiusSquared;
+	}
+
+	void
+	Insert(
+		uint32_t* Cell,
+		uint32_t EntityIndex
+		)
+	{
+		if(!*Cell)
+		{
+			this->Cells.Occupy(Cell);
+		}
+
+		uint32_t Index = this->References.Get();
+		this->References[Index].Next = *Cell;
+		this->References[Index].Ref = EntityIndex;
+		*Cell = Index;
+	}
+
+	void
+	Remove(
+		uint32_t* Cell,
+		uint32_t EntityIndex
+		)
+	{
+		uint32_t* Link = Cell;
+		while(*Link)
+		{
+			uint32_t Index = *Link;
+			UGridReference& Reference = this->References[Index];
+			if(Reference.Ref == EntityIndex)
+			{
+				*Link = Reference.Next;
+				this->References.Ret(Index);
+
+				if(!*Cell)
+				{
+					this->Cells.Release(Cell);
+				}
+				return;
+			}
+
+			Link = &Reference.Next;
+		}
+	}
+
+	/*
+	 * Loose cells only look as far as LooseDim around an entity's Pos, a
+	 * larger box would be missed by queries and Tick() without notice. The
+	 * bound of the last level is the largest.
+	 */
+	void
+	CheckDim(
+		UGridDim Dim
+		)
+	{
+		float Scale = float(1u << (this->LevelCount - 1));
+		if(this->Loose && (Dim.W > this->LooseDim.W * Scale || Dim.H > this->LooseDim.H * Scale))
+		{
+			throw std::invalid_argument("UGrid: Dim exceeds the MaxDim given to SetLoose()");
+		}
+	}
+
+	/*
+	 * Handle slots keep the layer and level next to the entity index, so
+	 * the index must not grow past IndexMask.
+	 */
+	uint32_t
+	GetEntityIndex(
+		)
+	{
+		uint32_t Index = this->Entities.Get();
+		if(Index > IndexMask)
+		{
+			this->Entities.Ret(Index);
+			throw std::length_error("UGrid: too many entities in one layer");
+		}
+
+		return Index;
+	}
+
+	uint32_t
+	Add(
+		EntityType Entity,
+		UGridFilter Filter
+		)
+	{
+		this->CheckDim(Entity.Dim);
+		uint32_t Index = this->GetEntityIndex();
+
+		uint32_t UsedHandles = this->Handles.GetUsed();
+		uint32_t HandleIndex = this->Handles.Get();
+		UGridHandleSlot& Slot = this->Handles[HandleIndex];
+		if(HandleIndex == UsedHandles)
+		{
+			Slot.Generation = 0;
+		}
+
+		Slot.Entity = Index | this->LayerBit;
+
+		Entity.Copied = 0;
+		Entity.Handle = HandleIndex;
+		Entity.Sleeping = 0;
+		this->Entities.Set(Index, Entity, Filter);
+
+		return Index;
+	}
+
+	/*
+	 * Checked up front by BulkInsert(), counting the slots of removed
+	 * entities as taken.
+	 */
+	void
+	CheckRoom(
+		uint64_t Count
+		)
+	{
+		if(this->Entities.GetUsed() + Count > uint64_t(IndexMask) + 1)
+		{
+			throw std::length_error("UGrid: too many entities in one layer");
+		}
+	}
+
+	/*
+	 * Narrows a range of cells to the bounds of the occupied ones, leaving
+	 * Start past End if it misses them. Cells only kept while occupied would
+	 * otherwise all be probed, however far out the range reaches.
+	 */
+	void
+	ClipToOccupied(
+		UGridCell& Start,
+		UGridCell& End
+		)
+	{
+		UGridCell Min = this->Cells.GetMin();
+		UGridCell Max = this->Cells.GetMax();
+		Start = { std::max(Start.X, Min.X), std::max(Start.Y, Min.Y) };
+		End = { std::min(End.X, Max.X), std::min(End.Y, Max.Y) };
+	}
+
+	/*
+	 * Query() reporting entity indices.
+	 */
+	template<typename Fn>
+	void
+	QueryIndices(
+		UGridPos Pos,
+		UGridDim Dim,
+		Fn&& Callback
+		)
+	{
+		/* Loose cells hold entities reaching up to LooseDim out of them,
+		 * but every entity only once */
+		UGridCell Start = this->PosToCell({ Pos.X - Dim.W - this->LooseDim.W, Pos.Y - Dim.H - this->LooseDim.H });
+		UGridCell End = this->PosToCell({ Pos.X + Dim.W + this->LooseDim.W, Pos.Y + Dim.H + this->LooseDim.H });
+		this->ClipToOccupied(Start, End);
+
+		for(uint32_t X = Start.X; X <= End.X; ++X)
+		{
+			for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+			{
+				uint32_t i = this->GetHead(X, Y);
+				while(i)
+				{
+					UGridReference& Reference = this->References[i];
+					i = Reference.Next;
+					uint32_t Index = Reference.Ref;
+
+					if(!Overlaps(this->Entities.GetPos(Index), this->Entities.GetDim(Index), Pos, Dim))
+					{
+						continue;
+					}
+
+					if(!this->Loose && (X != Start.X || Y != Start.Y))
+					{
+						UGridCell EntityStart = this->GetStart(Index);
+						if((X != Start.X && X != EntityStart.X) || (Y != Start.Y && Y != EntityStart.Y))
+						{
+							continue;
+						}
+					}
+
+					Callback(Index);
+				}
+			}
+		}
+	}
+
+	/*
+	 * The static layer is only laid out again once an eighth of it changed,
+	 * as its order does not matter to Tick() and sleeping entities come and
+	 * go all the time.
+	 */
+	void
+	OptimizeStatic(
+		)
+	{
+		if(!this->StaticChanges)
+		{
+			return;
+		}
+
+		uint32_t Used = 0;
+		this->Static->ForEachLayer([&](UGrid& Layer)
+		{
+			Used += Layer.Entities.GetUsed();
+		});
+
+		if(this->StaticChanges * 8 >= Used)
+		{
+			this->Static->ForEachLayer([](UGrid& Layer)
+			{
+				Layer.Optimize();
+			});
+			this->StaticChanges = 0;
+		}
+	}
+
+	void
+	Link(
+		uint32_t Index
+		)
+	{
+		UGridCell Start = this->GetStart(Index);
+		UGridCell End = this->GetEnd(Index);
+
+		for(uint32_t X = Start.X; X <= End.X; ++X)
+		{
+			for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+			{
+				this->Insert(this->GetCell(X, Y), Index);
+			}
+		}
+	}
+
+	void
+	Unlink(
+		uint32_t Index
+		)
+	{
+		UGridCell Start = this->GetStart(Index);
+		UGridCell End = this->GetEnd(Index);
+
+		for(uint32_t X = Start.X; X <= End.X; ++X)
+		{
+			for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+			{
+				this->Remove(this->GetCell(X, Y), Index);
+			}
+		}
+	}
+
+	/*
+	 * Moves an entity from one layer to another, keeping its handle. Entity
+	 * is what it looks like afterwards, a copy of it with Sleeping or its
+	 * geometry changed.
+	 */
+	void
+	Transfer(
+		UGrid& From,
+		UGrid& To,
+		uint32_t HandleIndex,
+		EntityType Entity
+		)
+	{
+		UGridHandleSlot& Slot = this->Handles[HandleIndex];
+		uint32_t Index = Slot.Entity & IndexMask;
+		uint32_t NewIndex = To.GetEntityIndex();
+		UGridFilter Filter = From.Entities.GetFilter(Index);
+
+		From.Unlink(Index);
+		From.Entities.Ret(Index);
+
+		Slot.Entity = NewIndex | To.LayerBit;
+
+		Entity.Copied = 0;
+		To.Entities.Set(NewIndex, Entity, Filter);
+		To.Link(NewIndex);
+	}
+
+	void
+	WakeAll(
+		const WakeList& HandleIndices
+		)
+	{
+		for(uint32_t HandleIndex : HandleIndices)
+		{
+			this->Wake({ HandleIndex, this->Handles[HandleIndex].Generation });
+		}
+	}
+
+	UGridHandle
+	GetHandle(
+		uint32_t Index
+		)
+	{
+		uint32_t HandleIndex = this->Entities[Index].Handle;
+		return { HandleIndex, this->Handles[HandleIndex].Generation };
+	}
+
+	void
+	Optimize(
+		)
+	{
+		EntityStorage& NewEntities = this->SpareEntities;
+		NewEntities.Prepare(this->Entities);
+		uint32_t CurrentEntity = 1;
+
+		ReferenceList& NewReferences = this->SpareReferences;
+		NewReferences.Prepare(this->References);
+		UGridReference* HeadReference = NewReferences.GetPtr();
+		UGridReference* CurrentReference = HeadReference + 1;
+
+		this->Cells.Sort();
+		this->Cells.ForEach(0, this->Cells.GetLast().X + 1, [&](UGridCell, uint32_t& Head)
+		{
+			uint32_t i = Head;
+			Head = CurrentReference - HeadReference;
+
+			while(i)
+			{
+				UGridReference& Reference = this->References[i];
+				i = Reference.Next;
+				EntityType& Entity = this->Entities[Reference.Ref];
+
+				if(!Entity.Copied)
+				{
+					NewEntities.Copy(CurrentEntity, this->Entities, Reference.Ref);
+					Entity.Copied = CurrentEntity;
+					this->Handles[Entity.Handle].Entity = CurrentEntity | this->LayerBit;
+					++CurrentEntity;
+				}
+
+				UGridReference* NextReference = CurrentReference + 1;
+				CurrentReference->Next = i ? NextReference - HeadReference : 0;
+				CurrentReference->Ref = Entity.Copied;
+				CurrentReference = NextReference;
+			}
+		});
+
+		NewEntities.SetUsed(CurrentEntity);
+		NewReferences.SetEnd(CurrentReference);
+
+		this->Entities.Swap(NewEntities);
+		this->References.Swap(NewReferences);
+	}
+
+	template<typename Fn>
+	static void
+	RunThreads(
+		uint32_t ThreadCount,
+		Fn&& Work
+		)
+	{
+		std::vector<std::thread> Threads;
+		Threads.reserve(ThreadCount - 1);
+
+		for(uint32_t Thread = 1; Thread < ThreadCount; ++Thread)
+		{
+			Threads.emplace_back(Work, Thread);
+		}
+
+		Work(0);
+
+		for(std::thread& Thread : Threads)
+		{
+			Thread.join();
+		}
+	}
+
+	/*
+	 * Number of columns from the first to the last one with occupied cells.
+	 */
+	uint64_t
+	GetColumnCount(
+		)
+	{
+		UGridCell Min = this->Cells.GetMin();
+		UGridCell Max = this->Cells.GetMax();
+		return Min.X <= Max.X ? uint64_t(Max.X - Min.X) + 1 : 0;
+	}
+
+	/*
+	 * First column of a strip, or one past the last column of the last strip
+	 * for Thread == ThreadCount.
+	 */
+	uint32_t
+	GetStripBegin(
+		uint32_t Thread,
+		uint32_t ThreadCount
+		)
+	{
+		return this->Cells.GetMin().X + this->GetColumnCount() * Thread / ThreadCount;
+	}
+
+	/*
+	 * ThreadCount limited to one thread per column with occupied cells. The
+	 * cells are sorted first, which their bounds may need.
+	 */
+	uint32_t
+	LimitThreads(
+		uint32_t ThreadCount
+		)
+	{
+		this->Cells.Sort();
+		return std::max(uint64_t(1), std::min(uint64_t(ThreadCount), this->GetColumnCount()));
+	}
+
+	/*
+	 * Same result as Optimize(), computed by ThreadCount threads working on
+	 * strips of columns. Every strip first counts its references and the
+	 * entities that start in it, an exclusive scan over the strips gives their
+	 * output offsets, and then the strips copy their entities and, once all
+	 * entities have their new index, their references. An entity is placed
+	 * when its start cell is reached, in list order, which is exactly where
+	 * the serial version first touches it.
+	 */
+	void
+	Optimize(
+		uint32_t ThreadCount
+		)
+	{
+		EntityStorage& NewEntities = this->SpareEntities;
+		NewEntities.Prepare(this->Entities);
+
+		ReferenceList& NewReferences = this->SpareReferences;
+		NewReferences.Prepare(this->References);
+		UGridReference* HeadReference = NewReferences.GetPtr();
+
+		ScratchList<uint32_t> EntityOffsets(ThreadCount + 1, this->Cells.GetAllocator());
+		ScratchList<uint32_t> ReferenceOffsets(ThreadCount + 1, this->Cells.GetAllocator());
+		this->Cells.Sort();
+
+		this->RunThreads(ThreadCount, [&](uint32_t Thread)
+		{
+			uint32_t EntityCount = 0;
+			uint32_t ReferenceCount = 0;
+
+			this->Cells.ForEach(this->GetStripBegin(Thread, ThreadCount), this->GetStripBegin(Thread + 1, ThreadCount), [&](UGridCell Cell, uint32_t Head)
+			{
+				for(uint32_t i = Head; i; i = this->References[i].Next)
+				{
+					UGridCell Start = this->GetStart(this->References[i].Ref);
+					EntityCount += Start.X == Cell.X && Start.Y == Cell.Y;
+					++ReferenceCount;
+				}
+			});
+
+			EntityOffsets[Thread + 1] = EntityCount;
+			ReferenceOffsets[Thread + 1] = ReferenceCount;
+		});
+
+		EntityOffsets[0] = 1;
+		ReferenceOffsets[0] = 1;
+		for(uint32_t Thread = 0; Thread < ThreadCount; ++Thread)
+		{
+			EntityOffsets[Thread + 1] += EntityOffsets[Thread];
+			ReferenceOffsets[Thread + 1] += ReferenceOffsets[Thread];
+		}
+
+		this->RunThreads(ThreadCount, [&](uint32_t Thread)
+		{
+			uint32_t CurrentEntity = EntityOffsets[Thread];
+
+			this->Cells.ForEach(this->GetStripBegin(Thread, ThreadCount), this->GetStripBegin(Thread + 1, ThreadCount), [&](UGridCell Cell, uint32_t Head)
+			{
+				for(uint32_t i = Head; i; i = this->References[i].Next)
+				{
+					uint32_t Index = this->References[i].Ref;
+					UGridCell Start = this->GetStart(Index);
+					if(Start.X != Cell.X || Start.Y != Cell.Y)
+					{
+						continue;
+					}
+
+					EntityType& Entity = this->Entities[Index];
+					NewEntities.Copy(CurrentEntity, this->Entities, Index);
+					Entity.Copied = CurrentEntity;
+					this->Handles[Entity.Handle].Entity = CurrentEntity | this->LayerBit;
+					++CurrentEntity;
+				}
+			});
+		});
+
+		this->RunThreads(ThreadCount, [&](uint32_t Thread)
+		{
+			UGridReference* CurrentReference = HeadReference + ReferenceOffsets[Thread];
+
+			this->Cells.ForEach(this->GetStripBegin(Thread, ThreadCount), this->GetStripBegin(Thread + 1, ThreadCount), [&](UGridCell, uint32_t& Head)
+			{
+				uint32_t i = Head;
+				Head = CurrentReference - HeadReference;
+
+				while(i)
+				{
+					UGridReference& Reference = this->References[i];
+					i = Reference.Next;
+
+					UGridReference* NextReference = CurrentReference + 1;
+					CurrentReference->Next = i ? NextReference - HeadReference : 0;
+					CurrentReference->Ref = this->Entities[Reference.Ref].Copied;
+					CurrentReference = NextReference;
+				}
+			});
+		});
+
+		NewEntities.SetUsed(EntityOffsets[ThreadCount]);
+		NewReferences.SetEnd(HeadReference + ReferenceOffsets[ThreadCount]);
+
+		this->Entities.Swap(NewEntities);
+		this->References.Swap(NewReferences);
+	}
+
+	/*
+	 * Returns the number of entities starting in a column before X, which
+	 * right after Optimize() is also the highest entity index referenced by
+	 * any cell before that column.
+	 */
+	uint32_t
+	GetMaxEntityIndexBefore(
+		uint32_t X
+		)
+	{
+		uint32_t Low = 1;
+		uint32_t High = this->Entities.GetUsed();
+		while(Low < High)
+		{
+			uint32_t Mid = Low + (High - Low) / 2;
+			if(this->GetStart(Mid).X < X)
+			{
+				Low = Mid + 1;
+			}
+			else
+			{
+				High = Mid;
+			}
+		}
+
+		return Low - 1;
+	}
+
+	/*
+	 * Geometry of the entities of one cell, gathered for the exact overlap
+	 * test. The arrays are padded with NaN past Count so that whole vectors
+	 * can be loaded; NaN never passes the test.
+	 */
+	struct UGridCellBatch
+	{
+		ScratchList<uint32_t> Refs;
+		ScratchList<float> X;
+		ScratchList<float> Y;
+		ScratchList<float> W;
+		ScratchList<float> H;
+		uint32_t Count = 0;
+
+		UGridCellBatch(
+			const CellAllocatorType& CellAllocator
+			) : Refs(CellAllocator), X(CellAllocator), Y(CellAllocator), W(CellAllocator), H(CellAllocator)
+		{
+		}
+	};
+
+	void
+	GatherCell(
+		uint32_t i,
+		UGridCellBatch& Batch
+		)
+	{
+		Batch.Refs.clear();
+		for(; i; i = this->References[i].Next)
+		{
+			Batch.Refs.push_back(this->References[i].Ref);
+		}
+
+		Batch.Count = Batch.Refs.size();
+		uint32_t Padded = Batch.Count + 8;
+		Batch.X.resize(Padded);
+		Batch.Y.resize(Padded);
+		Batch.W.resize(Padded);
+		Batch.H.resize(Padded);
+
+		for(uint32_t k = 0; k < Batch.Count; ++k)
+		{
+			UGridPos Pos = this->Entities.GetPos(Batch.Refs[k]);
+			UGridDim Dim = this->Entities.GetDim(Batch.Refs[k]);
+			Batch.X[k] = Pos.X;
+			Batch.Y[k] = Pos.Y;
+			Batch.W[k] = Dim.W;
+			Batch.H[k] = Dim.H;
+		}
+
+		for(uint32_t k = Batch.Count; k < Padded; ++k)
+		{
+			Batch.X[k] = NAN;
+			Batch.Y[k] = NAN;
+			Batch.W[k] = NAN;
+			Batch.H[k] = NAN;
+		}
+	}
+
+	/*
+	 * Calls Report(j) for every j in (i, Batch.Count) whose box overlaps the
+	 * box of i, testing a vector of cell-mates at a time.
+	 */
+	template<typename Fn>
+	static void
+	OverlapCell(
+		const UGridCellBatch& Batch,
+		uint32_t i,
+		Fn&& Report
+		)
+	{
+		const float* X = Batch.X.data();
+		const float* Y = Batch.Y.data();
+		const float* W = Batch.W.data();
+		const float* H = Batch.H.data();
+
+#if defined(__AVX__)
+		__m256 SignMask = _mm256_set1_ps(-0.0f);
+		__m256 XI = _mm256_set1_ps(X[i]);
+		__m256 YI = _mm256_set1_ps(Y[i]);
+		__m256 WI = _mm256_set1_ps(W[i]);
+		__m256 HI = _mm256_set1_ps(H[i]);
+
+		for(uint32_t j = i + 1; j < Batch.Count; j += 8)
+		{
+			__m256 DX = _mm256_andnot_ps(SignMask, _mm256_sub_ps(XI, _mm256_loadu_ps(X + j)));
+			__m256 DY = _mm256_andnot_ps(SignMask, _mm256_sub_ps(YI, _mm256_loadu_ps(Y + j)));
+			__m256 SW = _mm256_add_ps(WI, _mm256_loadu_ps(W + j));
+			__m256 SH = _mm256_add_ps(HI, _mm256_loadu_ps(H + j));
+
+			uint32_t Mask = _mm256_movemask_ps(_mm256_and_ps(
+				_mm256_cmp_ps(DX, SW, _CMP_LE_OQ), _mm256_cmp_ps(DY, SH, _CMP_LE_OQ)));
+			while(Mask)
+			{
+				Report(j + __builtin_ctz(Mask));
+				Mask &= Mask - 1;
+			}
+		}
+#elif defined(__SSE2__)
+		__m128 SignMask = _mm_set1_ps(-0.0f);
+		__m128 XI = _mm_set1_ps(X[i]);
+		__m128 YI = _mm_set1_ps(Y[i]);
+		__m128 WI = _mm_set1_ps(W[i]);
+		__m128 HI = _mm_set1_ps(H[i]);
+
+		for(uint32_t j = i + 1; j < Batch.Count; j += 4)
+		{
+			__m128 DX = _mm_andnot_ps(SignMask, _mm_sub_ps(XI, _mm_loadu_ps(X + j)));
+			__m128 DY = _mm_andnot_ps(SignMask, _mm_sub_ps(YI, _mm_loadu_ps(Y + j)));
+			__m128 SW = _mm_add_ps(WI, _mm_loadu_ps(W + j));
+			__m128 SH = _mm_add_ps(HI, _mm_loadu_ps(H + j));
+
+			uint32_t Mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(DX, SW), _mm_cmple_ps(DY, SH)));
+			while(Mask)
+			{
+				Report(j + __builtin_ctz(Mask));
+				Mask &= Mask - 1;
+			}
+		}
+#else
+		for(uint32_t j = i + 1; j < Batch.Count; ++j)
+		{
+			if(std::abs(X[i] - X[j]) <= W[i] + W[j] && std::abs(Y[i] - Y[j]) <= H[i] + H[j])
+			{
+				Report(j);
+			}
+		}
+#endif
+	}
+
+	/*
+	 * Pairs the dynamic entities of a cell with the ones of the static layer
+	 * Static of the same level, reporting a pair only in the first cell both
+	 * entities share like TickColumns(). Sleeping entities that an awake one
+	 * overlaps have their handle index added to Wakes.
+	 */
+	template<bool Exact, typename Fn>
+	void
+	TickStaticCell(
+		UGrid& Static,
+		uint32_t X,
+		uint32_t Y,
+		uint32_t Head,
+		Fn& Callback,
+		WakeList& Wakes
+		)
+	{
+		uint32_t StaticHead = Static.GetHead(X, Y);
+		if(!StaticHead)
+		{
+			return;
+		}
+
+		for(uint32_t i = Head; i; i = this->References[i].Next)
+		{
+			uint32_t Ref = this->References[i].Ref;
+			UGridPos Pos = this->Entities.GetPos(Ref);
+			UGridDim Dim = this->Entities.GetDim(Ref);
+			UGridFilter Filter = this->Entities.GetFilter(Ref);
+			UGridCell Start = this->GetStart(Ref);
+
+			for(uint32_t j = StaticHead; j; j = Static.References[j].Next)
+			{
+				uint32_t StaticRef = Static.References[j].Ref;
+
+				if constexpr(Exact)
+				{
+					if(!Overlaps(Pos, Dim, Static.Entities.GetPos(StaticRef), Static.Entities.GetDim(StaticRef)))
+					{
+						continue;
+					}
+				}
+
+				if(X != Start.X || Y != Start.Y)
+				{
+					UGridCell StaticStart = Static.GetStart(StaticRef);
+					if((X != Start.X && X != StaticStart.X) || (Y != Start.Y && Y != StaticStart.Y))
+					{
+						continue;
+					}
+				}
+
+				if(!Collides(Filter, Static.Entities.GetFilter(StaticRef)))
+				{
+					continue;
+				}
+
+				EntityType& StaticEntity = Static.Entities[StaticRef];
+				if(
+					StaticEntity.Sleeping &&
+					(Exact || Overlaps(Pos, Dim, Static.Entities.GetPos(StaticRef), Static.Entities.GetDim(StaticRef)))
+					)
+				{
+					Wakes.push_back(StaticEntity.Handle);
+				}
+
+				Callback(this->Entities[Ref], StaticEntity);
+			}
+		}
+	}
+
+	/*
+	 * Reports the pairs of columns [XBegin, XEnd), including those with the
+	 * static layer Static of the same level if there is one.
+	 * GlobalMaxEntityIndex must be the highest entity index referenced by any
+	 * cell before XBegin. If Exact is set, only pairs whose boxes overlap are
+	 * reported.
+	 */
+	template<bool Exact, typename Fn>
+	void
+	TickColumns(
+		uint32_t XBegin,
+		uint32_t XEnd,
+		uint32_t GlobalMaxEntityIndex,
+		UGrid* Static,
+		Fn& Callback,
+		WakeList& Wakes
+		)
+	{
+		if(this->Loose)
+		{
+			this->template TickLooseColumns<Exact>(XBegin, XEnd, Static, Callback, Wakes);
+			return;
+		}
+
+		/*
+		 * After Optimize() entities are numbered in the order of the cell they
+		 * start in, so every entity above GlobalMaxEntityIndex starts in the
+		 * current cell and every entity above ColumnMaxEntityIndex starts in the
+		 * current column. A pair is reported only in the first cell both of its
+		 * entities share, which is the cell at the maximum of their start cells.
+		 */
+		UGridCellBatch Batch(this->Cells.GetAllocator());
+		uint32_t X = XBegin;
+		uint32_t ColumnMaxEntityIndex = GlobalMaxEntityIndex;
+
+		this->Cells.ForEach(XBegin, XEnd, [&](UGridCell Cell, uint32_t Head)
+		{
+			uint32_t Y = Cell.Y;
+
+			/* Empty cells leave GlobalMaxEntityIndex alone, so skipping
+			 * them only means catching up on the column here */
+			if(Cell.X != X)
+			{
+				X = Cell.X;
+				ColumnMaxEntityIndex = GlobalMaxEntityIndex;
+			}
+
+			auto Report = [&](uint32_t Ref, uint32_t OtherRef)
+			{
+				if(Ref <= GlobalMaxEntityIndex && OtherRef <= GlobalMaxEntityIndex)
+				{
+					/* Both started in earlier cells */
+					bool ColumnFresh = Ref > ColumnMaxEntityIndex;
+					bool OtherColumnFresh = OtherRef > ColumnMaxEntityIndex;
+					if(ColumnFresh == OtherColumnFresh)
+					{
+						return;
+					}
+
+					/* One started higher up in this column, the other
+					 * in an earlier column; report if that one starts
+					 * in this row. */
+					uint32_t Left = ColumnFresh ? OtherRef : Ref;
+					if(this->GetStart(Left).Y != Y)
+					{
+						return;
+					}
+				}
+
+				if(!Collides(this->Entities.GetFilter(Ref), this->Entities.GetFilter(OtherRef)))
+				{
+					return;
+				}
+
+				Callback(this->Entities[Ref], this->Entities[OtherRef]);
+			};
+
+			uint32_t LocalMaxEntityIndex = 0;
+
+			if constexpr(Exact)
+			{
+				uint32_t i = Head;
+				if(!this->References[i].Next)
+				{
+					LocalMaxEntityIndex = this->References[i].Ref;
+				}
+				else
+				{
+					this->GatherCell(i, Batch);
+
+					for(uint32_t k = 0; k < Batch.Count; ++k)
+					{
+						uint32_t Ref = Batch.Refs[k];
+						LocalMaxEntityIndex = std::max(LocalMaxEntityIndex, Ref);
+
+						OverlapCell(Batch, k, [&](uint32_t j)
+						{
+							Report(Ref, Batch.Refs[j]);
+						});
+					}
+				}
+			}
+			else
+			{
+				uint32_t i = Head;
+				while(i)
+				{
+					UGridReference& Reference = this->References[i];
+					i = Reference.Next;
+					LocalMaxEntityIndex = std::max(LocalMaxEntityIndex, Reference.Ref);
+
+					for(uint32_t j = i; j; j = this->References[j].Next)
+					{
+						Report(Reference.Ref, this->References[j].Ref);
+					}
+				}
+			}
+
+			GlobalMaxEntityIndex = std::max(GlobalMaxEntityIndex, LocalMaxEntityIndex);
+
+			if(Static)
+			{
+				this->template TickStaticCell<Exact>(*Static, X, Y, Head, Callback, Wakes);
+			}
+		});
+	}
+
+	/*
+	 * TickColumns() for loose cells, where entities are in a single cell and
+	 * need no deduplication. Every cell pairs its entities with each other,
+	 * with the ones of the cells after it in cell order that are within reach
+	 * of twice LooseDim, and with the static ones of every cell within reach.
+	 */
+	template<bool Exact, typename Fn>
+	void
+	TickLooseColumns(
+		uint32_t XBegin,
+		uint32_t XEnd,
+		UGrid* Static,
+		Fn& Callback,
+		WakeList& Wakes
+		)
+	{
+		UGridCell Reach = this->GetReach({ 2.0f * this->LooseDim.W, 2.0f * this->LooseDim.H });
+		UGridCell Min = this->Cells.GetMin();
+		UGridCell Max = this->Cells.GetMax();
+
+		auto Report = [&](uint32_t Ref, uint32_t OtherRef)
+		{
+			if constexpr(Exact)
+			{
+				if(!Overlaps(this->Entities.GetPos(Ref), this->Entities.GetDim(Ref), this->Entities.GetPos(OtherRef), this->Entities.GetDim(OtherRef)))
+				{
+					return;
+				}
+			}
+
+			if(!Collides(this->Entities.GetFilter(Ref), this->Entities.GetFilter(OtherRef)))
+			{
+				return;
+			}
+
+			Callback(this->Entities[Ref], this->Entities[OtherRef]);
+		};
+
+		auto ReportStatic = [&](uint32_t Ref, uint32_t StaticRef)
+		{
+			bool Overlapping = Overlaps(this->Entities.GetPos(Ref), this->Entities.GetDim(Ref), Static->Entities.GetPos(StaticRef), Static->Entities.GetDim(StaticRef));
+			if((Exact && !Overlapping) || !Collides(this->Entities.GetFilter(Ref), Static->Entities.GetFilter(StaticRef)))
+			{
+				return;
+			}
+
+			EntityType& StaticEntity = Static->Entities[StaticRef];
+			if(StaticEntity.Sleeping && Overlapping)
+			{
+				Wakes.push_back(StaticEntity.Handle);
+			}
+
+			Callback(this->Entities[Ref], StaticEntity);
+		};
+
+		this->Cells.ForEach(XBegin, XEnd, [&](UGridCell Cell, uint32_t Head)
+		{
+			for(uint32_t i = Head; i; i = this->References[i].Next)
+			{
+				for(uint32_t j = this->References[i].Next; j; j = this->References[j].Next)
+				{
+					Report(this->References[i].Ref, this->References[j].Ref);
+				}
+			}
+
+			int64_t XLast = std::min<int64_t>(int64_t(Cell.X) + Reach.X, Max.X);
+			int64_t YFirst = std::max<int64_t>(int64_t(Cell.Y) - Reach.Y, Min.Y);
+			int64_t YLast = std::min<int64_t>(int64_t(Cell.Y) + Reach.Y, Max.Y);
+
+			for(int64_t X = Cell.X; X <= XLast; ++X)
+			{
+				for(int64_t Y = X == Cell.X ? int64_t(Cell.Y) + 1 : YFirst; Y <= YLast; ++Y)
+				{
+					uint32_t OtherHead = this->GetHead(X, Y);
+					for(uint32_t j = OtherHead; j; j = this->References[j].Next)
+					{
+						for(uint32_t i = Head; i; i = this->References[i].Next)
+						{
+							Report(this->References[i].Ref, this->References[j].Ref);
+						}
+					}
+				}
+			}
+
+			if(!Static)
+			{
+				return;
+			}
+
+			UGridCell StaticMin = Static->Cells.GetMin();
+			UGridCell StaticMax = Static->Cells.GetMax();
+
+			for(int64_t X = std::max<int64_t>(int64_t(Cell.X) - Reach.X, StaticMin.X); X <= std::min<int64_t>(int64_t(Cell.X) + Reach.X, StaticMax.X); ++X)
+			{
+				for(int64_t Y = std::max<int64_t>(int64_t(Cell.Y) - Reach.Y, StaticMin.Y); Y <= std::min<int64_t>(int64_t(Cell.Y) + Reach.Y, StaticMax.Y); ++Y)
+				{
+					for(uint32_t j = Static->GetHead(X, Y); j; j = Static->References[j].Next)
+					{
+						for(uint32_t i = Head; i; i = this->References[i].Next)
+						{
+							ReportStatic(this->References[i].Ref, Static->References[j].Ref);
+						}
+					}
+				}
+			}
+		});
+	}
+
+	/*
+	 * Pairs of layers of different levels that Tick() tests against each
+	 * other, as the layer whose entities are iterated and the one they are
+	 * queried in. Static layers are never iterated, they are not compacted
+	 * every tick. Of two dynamic levels, the one whose entities cover fewer
+	 * cells of the other in total is iterated: a box covers at most two
+	 * cells a side of a coarser level and 2^d + 1 of a level d below its own.
+	 */
+	ScratchList<std::pair<UGrid*, UGrid*>>
+	GetLevelPairs(
+		)
+	{
+		ScratchList<std::pair<UGrid*, UGrid*>> Pairs(this->Cells.GetAllocator());
+
+		uint32_t Count = this->Levels.size() + 1;
+		for(uint32_t Level = 0; Level < Count; ++Level)
+		{
+			UGrid& Grid = this->GetLevelGrid(Level);
+			uint32_t Used = Grid.Entities.GetUsed() - 1;
+			if(!Used)
+			{
+				continue;
+			}
+
+			for(uint32_t Other = Level + 1; Other < Count; ++Other)
+			{
+				UGrid& OtherGrid = this->GetLevelGrid(Other);
+				uint32_t OtherUsed = OtherGrid.Entities.GetUsed() - 1;
+				if(!OtherUsed)
+				{
+					continue;
+				}
+
+				float Span = float(1u << (Other - Level)) + 1.0f;
+				if(OtherUsed * Span * Span < Used * 4.0f)
+				{
+					Pairs.push_back({ &OtherGrid, &Grid });
+				}
+				else
+				{
+					Pairs.push_back({ &Grid, &OtherGrid });
+				}
+			}
+
+			for(uint32_t Other = 0; this->Static && Other <= this->Static->Levels.size(); ++Other)
+			{
+				UGrid& OtherGrid = this->Static->GetLevelGrid(Other);
+				if(Other != Level && OtherGrid.Entities.GetUsed() != 1)
+				{
+					Pairs.push_back({ &Grid, &OtherGrid });
+				}
+			}
+		}
+
+		return Pairs;
+	}
+
+	/*
+	 * Reports the pairs of the entities [Begin, End) of Iterated with the
+	 * entities of Queried whose boxes they overlap, for layers of different
+	 * levels that share no cells. Sleeping entities have their handle index
+	 * added to Wakes.
+	 */
+	template<typename Fn>
+	void
+	TickLevels(
+		UGrid& Iterated,
+		UGrid& Queried,
+		uint32_t Begin,
+		uint32_t End,
+		Fn& Callback,
+		WakeList& Wakes
+		)
+	{
+		for(uint32_t Index = Begin; Index < End; ++Index)
+		{
+			UGridFilter Filter = Iterated.Entities.GetFilter(Index);
+
+			Queried.QueryIndices(Iterated.Entities.GetPos(Index), Iterated.Entities.GetDim(Index), [&](uint32_t Other)
+			{
+				if(!Collides(Filter, Queried.Entities.GetFilter(Other)))
+				{
+					return;
+				}
+
+				EntityType& Entity = Iterated.Entities[Index];
+				EntityType& OtherEntity = Queried.Entities[Other];
+				if(OtherEntity.Sleeping)
+				{
+					Wakes.push_back(OtherEntity.Handle);
+				}
+
+				Callback(Entity, OtherEntity);
+			});
+		}
+	}
+public:
+	UGrid(
+		UGridCell GridCells,
+		UGridDim CellDim,
+		const CellAllocatorType& CellAllocator = CellAllocatorType()
+		) : UGrid(GridCells, CellDim, CellAllocator, this->OwnHandles, 0)
+	{
+	}
+
+	UGrid(
+		const UGrid&
+		) = delete;
+
+	UGrid&
+	operator=(
+		const UGrid&
+		) = delete;
+
+	/*
+	 * Allocators must be set before anything is inserted, they also serve
+	 * the static layer and the handles respectively.
+	 */
+	void
+	SetEntityAllocator(
+		const Allocator& EntityAllocator
+		) noexcept
+	{
+		this->Entities.SetAllocator(EntityAllocator);
+		this->SpareEntities.SetAllocator(EntityAllocator);
+		this->OwnHandles.SetAllocator(EntityAllocator);
+	}
+
+	void
+	SetReferenceAllocator(
+		const RebindAllocator<UGridReference>& ReferenceAllocator
+		) noexcept
+	{
+		this->References.SetAllocator(ReferenceAllocator);
+		this->SpareReferences.SetAllocator(ReferenceAllocator);
+	}
+
+	/*
+	 * Splits the grid into Count levels, at most 16, the cells of level L
+	 * being 2^L times the size of the cells given to the constructor. Every
+	 * entity goes into the first level whose cells are at least as large as
+	 * its box, so it is in at most four cells however large it is, and moves
+	 * between levels as Update() resizes it. Must be set before anything is
+	 * inserted.
+	 */
+	void
+	SetLevelCount(
+		uint32_t Count
+		) noexcept
+	{
+		this->LevelCount = std::clamp(Count, 1u, MaxLevels);
+
+		if(this->Static)
+		{
+			this->Static->LevelCount = this->LevelCount;
+		}
+	}
+
+	/*
+	 * Switches to loose cells: every entity is only put into the cell that
+	 * contains its Pos, so it has a single reference and moving it touches
+	 * at most two cells. Queries and Tick() look into the neighbouring cells
+	 * that boxes can reach out of their cell instead, which MaxDim bounds
+	 * the half-extents of. Pairs that Tick() reports without Exact are the
+	 * ones in the same or neighbouring cells within reach. With several
+	 * levels the bound doubles with every level along with the cells, and
+	 * an entity goes into the first level whose bound it fits if that is
+	 * coarser than its size alone calls for. Must be set before anything is
+	 * inserted. Insert(), BulkInsert() and Update() throw
+	 * std::invalid_argument for a Dim larger than the bound of the last
+	 * level.
+	 */
+	void
+	SetLoose(
+		UGridDim MaxDim
+		) noexcept
+	{
+		this->ForEachLayer([&](UGrid& Layer)
+		{
+			float Scale = Layer.CellDim.W * this->InverseCellDim.W;
+			Layer.Loose = true;
+			Layer.LooseDim = { MaxDim.W * Scale, MaxDim.H * Scale };
+		});
+	}
+
+	/*
+	 * Returns a handle to the inserted entity. Unlike entity indices, handles
+	 * stay valid across Tick() until the entity is removed. Filter decides
+	 * which entities Tick() pairs it with, as SetFilter() does later on.
+	 */
+	UGridHandle
+	Insert(
+		EntityType Entity,
+		UGridFilter Filter = {}
+		)
+	{
+		UGrid& Layer = this->GetLevelGrid(this->GetLevelFor(Entity.Dim));
+		uint32_t Index = Layer.Add(Entity, Filter);
+		Layer.Link(Index);
+
+		return Layer.GetHandle(Index);
+	}
+
+	/*
+	 * Inserts an entity that is not going to move, such as a wall. Static
+	 * entities live in a separate layer that Tick() only optimizes after it
+	 * changed, and are paired with dynamic entities but never with each
+	 * other. The handle works with every other call like any other handle.
+	 */
+	UGridHandle
+	InsertStatic(
+		EntityType Entity,
+		UGridFilter Filter = {}
+		)
+	{
+		++this->StaticChanges;
+		return this->GetStatic().Insert(Entity, Filter);
+	}
+
+	/*
+	 * Inserts many entities at once. References are counting sorted by cell,
+	 * together with the ones already in the grid, into the spare reference
+	 * array that Optimize() also builds into, so that every cell's list is
+	 * one contiguous run, and the spare is then swapped in. If Handles is not
+	 * empty, the handle of NewEntities[i] is written to Handles[i], and if
+	 * Filters is not empty, NewEntities[i] is inserted with Filters[i].
+	 */
+	void
+	BulkInsert(
+		std::span<const EntityType> NewEntities,
+		std::span<UGridHandle> Handles = {},
+		std::span<const UGridFilter> Filters = {}
+		)
+	{
+		uint32_t Count = NewEntities.size();
+
+		/* Checked before anything is counted into the cells */
+		for(const EntityType& Entity : NewEntities)
+		{
+			this->CheckDim(Entity.Dim);
+		}
+
+		/* Entities of several levels are inserted one level at a time */
+		if(this->LevelCount > 1)
+		{
+			ScratchList<uint32_t> EntityLevels(Count, this->Cells.GetAllocator());
+			ScratchList<uint32_t> LevelCounts(this->LevelCount, this->Cells.GetAllocator());
+			bool Mixed = false;
+			for(uint32_t k = 0; k < Count; ++k)
+			{
+				EntityLevels[k] = this->GetLevelFor(NewEntities[k].Dim);
+				++LevelCounts[EntityLevels[k]];
+				Mixed |= EntityLevels[k] != 0;
+			}
+
+			if(Mixed)
+			{
+				for(uint32_t Level = 0; Level < this->LevelCount; ++Level)
+				{
+					if(LevelCounts[Level])
+					{
+						this->GetLevelGrid(Level).CheckRoom(LevelCounts[Level]);
+					}
+				}
+
+				ScratchList<EntityType> LevelEntities(this->Cells.GetAllocator());
+				ScratchList<UGridHandle> LevelHandles(this->Cells.GetAllocator());
+				ScratchList<UGridFilter> LevelFilters(this->Cells.GetAllocator());
+
+				for(uint32_t Level = 0; Level < this->LevelCount; ++Level)
+				{
+					LevelEntities.clear();
+					LevelFilters.clear();
+					for(uint32_t k = 0; k < Count; ++k)
+					{
+						if(EntityLevels[k] == Level)
+						{
+							LevelEntities.push_back(NewEntities[k]);
+							if(k < Filters.size())
+							{
+								LevelFilters.push_back(Filters[k]);
+							}
+						}
+					}
+
+					if(LevelEntities.empty())
+					{
+						continue;
+					}
+
+					LevelHandles.resize(LevelEntities.size());
+					this->GetLevelGrid(Level).BulkInsert(LevelEntities, LevelHandles, LevelFilters);
+
+					for(uint32_t k = 0, j = 0; k < Count; ++k)
+					{
+						if(EntityLevels[k] == Level && k < Handles.size())
+						{
+							Handles[k] = LevelHandles[j];
+						}
+						j += EntityLevels[k] == Level;
+					}
+				}
+
+				return;
+			}
+		}
+
+		this->CheckRoom(Count);
+
+		/* Cells only kept while occupied are added up front, as adding
+		 * them later could move the slots counted so far */
+		if constexpr(!CellStorageType::Bounded)
+		{
+			uint64_t Touched = 0;
+			for(const EntityType& Entity : NewEntities)
+			{
+				UGridDim Dim = this->Loose ? UGridDim{ 0.0f, 0.0f } : Entity.Dim;
+				UGridCell Start = this->PosToCell({ Entity.Pos.X - Dim.W, Entity.Pos.Y - Dim.H });
+				UGridCell End = this->PosToCell({ Entity.Pos.X + Dim.W, Entity.Pos.Y + Dim.H });
+				Touched += uint64_t(End.X - Start.X + 1) * (End.Y - Start.Y + 1);
+			}
+
+			this->Cells.Reserve(Touched);
+		}
+
+		uint32_t* CellHeads = this->Cells.GetHeads();
+		uint32_t Slots = this->Cells.GetSlots();
+
+		uint32_t Total = 1;
+
+		/* The heads are used for counting, existing lists are walked from
+		 * a copy of them */
+		ScratchList<uint32_t> Heads(this->Cells.GetAllocator());
+		if(this->References.GetUsed() != 1)
+		{
+			Heads.assign(CellHeads, CellHeads + Slots);
+
+			for(uint32_t Cell = 0; Cell < Slots; ++Cell)
+			{
+				uint32_t CellCount = 0;
+				for(uint32_t i = Heads[Cell]; i; i = this->References[i].Next)
+				{
+					++CellCount;
+				}
+				CellHeads[Cell] = CellCount;
+				Total += CellCount;
+			}
+		}
+
+		this->Entities.Reserve(this->Entities.GetUsed() + Count);
+		this->Handles.Reserve(this->Handles.GetUsed() + Count);
+		ScratchList<uint32_t> Indices(Count, this->Cells.GetAllocator());
+
+		for(uint32_t k = 0; k < Count; ++k)
+		{
+			uint32_t Index = this->Add(NewEntities[k], k < Filters.size() ? Filters[k] : UGridFilter());
+			Indices[k] = Index;
+			if(k < Handles.size())
+			{
+				Handles[k] = this->GetHandle(Index);
+			}
+
+			UGridCell Start = this->GetStart(Index);
+			UGridCell End = this->GetEnd(Index);
+
+			for(uint32_t X = Start.X; X <= End.X; ++X)
+			{
+				for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+				{
+					++*this->GetCell(X, Y);
+				}
+			}
+
+			Total += (End.X - Start.X + 1) * (End.Y - Start.Y + 1);
+		}
+
+		ReferenceList& NewReferences = this->SpareReferences;
+		NewReferences.Prepare(this->References);
+		NewReferences.Reserve(Total);
+		UGridReference* HeadReference = NewReferences.GetPtr();
+
+		/*
+		 * Link every cell's run up front and leave the head one past its
+		 * end. Filling the runs back to front then leaves the heads pointing
+		 * at their first reference. Empty cells are never filled, so they
+		 * get their final zero head right away.
+		 */
+		uint32_t Begin = 1;
+		for(uint32_t* Cell = CellHeads; Cell < CellHeads + Slots; ++Cell)
+		{
+			uint32_t End = Begin + *Cell;
+			*Cell = Begin != End ? End : 0;
+			if(Begin != End)
+			{
+				this->Cells.Occupy(Cell);
+
+				for(uint32_t i = Begin; i < End; ++i)
+				{
+					HeadReference[i].Next = i + 1;
+				}
+				HeadReference[End - 1].Next = 0;
+			}
+
+			Begin = End;
+		}
+
+		for(uint32_t Cell = 0; Cell < Heads.size(); ++Cell)
+		{
+			for(uint32_t i = Heads[Cell]; i; i = this->References[i].Next)
+			{
+				HeadReference[--CellHeads[Cell]].Ref = this->References[i].Ref;
+			}
+		}
+
+		for(uint32_t Index : Indices)
+		{
+			UGridCell Start = this->GetStart(Index);
+			UGridCell End = this->GetEnd(Index);
+
+			for(uint32_t X = Start.X; X <= End.X; ++X)
+			{
+				for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+				{
+					HeadReference[--*this->GetCell(X, Y)].Ref = Index;
+				}
+			}
+		}
+
+		NewReferences.SetEnd(HeadReference + Begin);
+		this->References.Swap(NewReferences);
+	}
+
+	bool
+	IsValid(
+		UGridHandle Handle
+		)
+	{
+		return
+			Handle.Index && Handle.Index < this->Handles.GetUsed() &&
+			this->Handles[Handle.Index].Generation == Handle.Generation;
+	}
+
+	/*
+	 * The handle must be valid. The reference is invalidated by Insert(),
+	 * InsertStatic(), BulkInsert() and Tick(), and by every call that moves
+	 * an entity between the dynamic and static layers: Sleep(), Wake(),
+	 * Update() of a sleeping entity and Tick() waking entities up, as well as
+	 * by Update() resizing an entity into another level. Pos and Dim must
+	 * only be changed through Update(), otherwise the cell lists go stale.
+	 */
+	EntityType&
+	Get(
+		UGridHandle Handle
+		)
+	{
+		if(this->IsStatic(Handle))
+		{
+			return this->Static->Get(Handle);
+		}
+
+		return this->GetLayer(Handle).Entities[this->GetIndex(Handle)];
+	}
+
+	void
+	Remove(
+		UGridHandle Handle
+		)
+	{
+		if(this->IsStatic(Handle))
+		{
+			this->Static->Remove(Handle);
+			++this->StaticChanges;
+			return;
+		}
+
+		UGridHandleSlot& Slot = this->Handles[Handle.Index];
+		UGrid& Layer = this->GetLayer(Handle);
+		uint32_t Index = this->GetIndex(Handle);
+
+		Layer.Unlink(Index);
+		Layer.Entities.Ret(Index);
+
+		++Slot.Generation;
+		this->Handles.Ret(Handle.Index);
+	}
+
+	/*
+	 * Moves or resizes an entity, waking it up if it was asleep. Only cells
+	 * that the entity enters or leaves have their lists modified, unless it
+	 * is resized into another level.
+	 */
+	void
+	Update(
+		UGridHandle Handle,
+		UGridPos Pos,
+		UGridDim Dim
+		)
+	{
+		this->CheckDim(Dim);
+		this->Wake(Handle);
+
+		if(this->IsStatic(Handle))
+		{
+			this->Static->Update(Handle, Pos, Dim);
+			++this->StaticChanges;
+			return;
+		}
+
+		UGrid& Layer = this->GetLayer(Handle);
+		UGrid& Target = this->GetLevelGrid(this->GetLevelFor(Dim));
+		if(&Layer != &Target)
+		{
+			EntityType Entity = Layer.Entities[this->GetIndex(Handle)];
+			Entity.Pos = Pos;
+			Entity.Dim = Dim;
+			this->Transfer(Layer, Target, Handle.Index, Entity);
+			return;
+		}
+
+		if(&Layer != this)
+		{
+			Layer.Update(Handle, Pos, Dim);
+			return;
+		}
+
+		uint32_t Index = this->GetIndex(Handle);
+
+		UGridCell OldStart = this->GetStart(Index);
+		UGridCell OldEnd = this->GetEnd(Index);
+
+		this->Entities.SetGeometry(Index, Pos, Dim);
+
+		UGridCell NewStart = this->GetStart(Index);
+		UGridCell NewEnd = this->GetEnd(Index);
+
+		if(
+			OldStart.X == NewStart.X && OldStart.Y == NewStart.Y &&
+			OldEnd.X == NewEnd.X && OldEnd.Y == NewEnd.Y
+			)
+		{
+			return;
+		}
+
+		for(uint32_t X = OldStart.X; X <= OldEnd.X; ++X)
+		{
+			for(uint32_t Y = OldStart.Y; Y <= OldEnd.Y; ++Y)
+			{
+				if(!Contains(NewStart, NewEnd, X, Y))
+				{
+					this->Remove(this->GetCell(X, Y), Index);
+				}
+			}
+		}
+
+		for(uint32_t X = NewStart.X; X <= NewEnd.X; ++X)
+		{
+			for(uint32_t Y = NewStart.Y; Y <= NewEnd.Y; ++Y)
+			{
+				if(!Contains(OldStart, OldEnd, X, Y))
+				{
+					this->Insert(this->GetCell(X, Y), Index);
+				}
+			}
+		}
+	}
+
+	bool
+	IsAsleep(
+		UGridHandle Handle
+		)
+	{
+		return this->IsStatic(Handle) && this->Get(Handle).Sleeping;
+	}
+
+	/*
+	 * Puts a dynamic entity to sleep. Sleeping entities are moved into the
+	 * static layer, so Optimize() no longer copies them and Tick() does not
+	 * pair them with each other or with static entities. An awake entity
+	 * overlapping a sleeping one wakes it up once Tick() is done, as does
+	 * Update() or Wake(). The handle stays the same.
+	 */
+	void
+	Sleep(
+		UGridHandle Handle
+		)
+	{
+		if(this->IsStatic(Handle))
+		{
+			return;
+		}
+
+		uint32_t Level = this->GetLevelOf(Handle);
+		EntityType Entity = this->Get(Handle);
+		Entity.Sleeping = 1;
+
+		this->Transfer(this->GetLevelGrid(Level), this->GetStatic().GetLevelGrid(Level), Handle.Index, Entity);
+		++this->StaticChanges;
+	}
+
+	void
+	Wake(
+		UGridHandle Handle
+		)
+	{
+		if(!this->IsAsleep(Handle))
+		{
+			return;
+		}
+
+		uint32_t Level = this->GetLevelOf(Handle);
+		EntityType Entity = this->Get(Handle);
+		Entity.Sleeping = 0;
+
+		this->Transfer(this->Static->GetLevelGrid(Level), this->GetLevelGrid(Level), Handle.Index, Entity);
+		++this->StaticChanges;
+	}
+
+	/*
+	 * Changes which entities Tick() pairs this one with.
+	 */
+	void
+	SetFilter(
+		UGridHandle Handle,
+		uint32_t Category,
+		uint32_t Mask
+		)
+	{
+		if(this->IsStatic(Handle))
+		{
+			this->Static->SetFilter(Handle, Category, Mask);
+			return;
+		}
+
+		this->GetLayer(Handle).Entities.SetFilter(this->GetIndex(Handle), { Category, Mask });
+	}
+
+	/*
+	 * Category and Mask of an entity, as last given on insertion or to
+	 * SetFilter(), { 1, UINT32_MAX } by default.
+	 */
+	UGridFilter
+	GetFilter(
+		UGridHandle Handle
+		)
+	{
+		if(this->IsStatic(Handle))
+		{
+			return this->Static->GetFilter(Handle);
+		}
+
+		return this->GetLayer(Handle).Entities.GetFilter(this->GetIndex(Handle));
+	}
+
+	/*
+	 * Calls Callback once for every entity whose box overlaps the box at Pos
+	 * with half-extents Dim. An entity spanning several cells is reported only
+	 * in the first cell it shares with the query box. The callback must not
+	 * modify the grid.
+	 */
+	template<typename Fn>
+	void
+	Query(
+		UGridPos Pos,
+		UGridDim Dim,
+		Fn&& Callback
+		)
+	{
+		this->ForEachLayer([&](UGrid& Layer)
+		{
+			Layer.QueryIndices(Pos, Dim, [&](uint32_t Index)
+			{
+				Callback(Layer.Entities[Index]);
+			});
+		});
+	}
+
+	/*
+	 * Runs every query box in Boxes and stores what each found in Results.
+	 * The queries are executed in order of their first cell rather than in
+	 * the given order, so that queries touching the same cells run back to
+	 * back while those cells and their entities are still in cache.
+	 */
+	void
+	QueryBatch(
+		std::span<const UGridBox> Boxes,
+		UGridBatchResults& Results
+		)
+	{
+		uint32_t Count = Boxes.size();
+
+		ScratchList<std::pair<uint64_t, uint32_t>> Order(Count, this->Cells.GetAllocator());
+		for(uint32_t i = 0; i < Count; ++i)
+		{
+			const UGridBox& Box = Boxes[i];
+			UGridCell Start = this->PosToCell({ Box.Pos.X - Box.Dim.W, Box.Pos.Y - Box.Dim.H });
+			Order[i] = { GetCellKey(Start), i };
+		}
+		std::sort(Order.begin(), Order.end());
+
+		/*
+		 * Handles are gathered in execution order and scattered into query
+		 * order once every count is known.
+		 */
+		ScratchList<UGridHandle> Found(this->Cells.GetAllocator());
+		ScratchList<uint32_t> FoundOffsets(Count, this->Cells.GetAllocator());
+		Results.Offsets.assign(Count + 1, 0);
+
+		for(const auto& [Key, i] : Order)
+		{
+			FoundOffsets[i] = Found.size();
+
+			this->ForEachLayer([&](UGrid& Layer)
+			{
+				Layer.QueryIndices(Boxes[i].Pos, Boxes[i].Dim, [&](uint32_t Index)
+				{
+					Found.push_back(Layer.GetHandle(Index));
+				});
+			});
+
+			Results.Offsets[i + 1] = Found.size() - FoundOffsets[i];
+		}
+
+		for(uint32_t i = 0; i < Count; ++i)
+		{
+			Results.Offsets[i + 1] += Results.Offsets[i];
+		}
+
+		Results.Handles.resize(Found.size());
+		for(uint32_t i = 0; i < Count; ++i)
+		{
+			std::copy(
+				Found.begin() + FoundOffsets[i],
+				Found.begin() + FoundOffsets[i] + (Results.Offsets[i + 1] - Results.Offsets[i]),
+				Results.Handles.begin() + Results.Offsets[i]
+				);
+		}
+	}
+
+	/*
+	 * Calls Callback once for every entity whose box overlaps the circle at
+	 * Center. Cells of the circle's bounding box that the circle does not
+	 * reach are skipped. An entity is reported in the first cell, in cell
+	 * order, that it shares with the bounding box and that is not skipped.
+	 * The callback must not modify the grid.
+	 */
+	template<typename Fn>
+	void
+	QueryCircle(
+		UGridPos Center,
+		float Radius,
+		Fn&& Callback
+		)
+	{
+		UGridCell Start = this->PosToCell({ Center.X - Radius - this->LooseDim.W, Center.Y - Radius - this->LooseDim.H });
+		UGridCell End = this->PosToCell({ Center.X + Radius + this->LooseDim.W, Center.Y + Radius + this->LooseDim.H });
+		this->ClipToOccupied(Start, End);
+		UGridCell CenterCell = this->PosToCell(Center);
+		float CellRadiusSquared = this->GetCellRadiusSquared(Radius);
+
+		for(uint32_t X = Start.X; X <= End.X; ++X)
+		{
+			float DX = std::max(this->GetColumnDistance(X, Center.X) - this->LooseDim.W, 0.0f);
+			float DXSquared = DX * DX;
+
+			for(uint32_t Y = Start.Y; Y <= End.Y; ++Y)
+			{
+				float DY = std::max(this->GetRowDistance(Y, Center.Y) - this->LooseDim.H, 0.0f);
+				if(DXSquared + DY * DY > CellRadiusSquared)
+				{
+					continue;
+				}
+
+				uint32_t i = this->GetHead(X, Y);
+				while(i)
+				{
+					UGridReference& Reference = this->References[i];
+					i = Reference.Next;
+					uint32_t Index = Reference.Ref;
+
+					if(!OverlapsCircle(this->Entities.GetPos(Index), this->Entities.GetDim(Index), Center, Radius))
+					{
+						continue;
+					}
+
+					if(this->Loose)
+					{
+						Callback(this->Entities[Index]);
+						continue;
+					}
+
+					UGridCell First = Start;
+					if(X != Start.X || Y != Start.Y)
+					{
+						UGridCell EntityStart = this->GetStart(Index);
+						First = { std::max(EntityStart.X, Start.X), std::max(EntityStart.Y, Start.Y) };
+					}
+
+					if(X != First.X || Y != First.Y)
+					{
+						if(!this->IsCellOutsideCircle(First.X, First.Y, Center, CellRadiusSquared))
+						{
+							continue;
+						}
+
+						/* The first shared cell is skipped, look for the first
+						 * one that is not. In every column the cell closest to
+						 * the center's row is the closest to the circle. */
+						UGridCell EntityEnd = this->GetEnd(Index);
+						UGridCell Last = { std::min(EntityEnd.X, End.X), std::min(EntityEnd.Y, End.Y) };
+						uint32_t ClosestY = std::clamp(CenterCell.Y, First.Y, Last.Y);
+
+						UGridCell Found = First;
+						for(Found.X = First.X; Found.X < X; ++Found.X)
+						{
+							if(!this->IsCellOutsideCircle(Found.X, ClosestY, Center, CellRadiusSquared))
+							{
+								break;
+							}
+						}
+
+						for(Found.Y = First.Y; Found.Y < Y; ++Found.Y)
+						{
+							if(!this->IsCellOutsideCircle(Found.X, Found.Y, Center, CellRadiusSquared))
+							{
+								break;
+							}
+						}
+
+						if(Found.X != X || Found.Y != Y)
+						{
+							continue;
+						}
+					}
+
+					Callback(this->Entities[Index]);
+				}
+			}
+		}
+
+		for(std::unique_ptr<UGrid>& Level : this->Levels)
+		{
+			Level->QueryCircle(Center, Radius, Callback);
+		}
+
+		if(this->Static)
+		{
+			this->Static->QueryCircle(Center, Radius, Callback);
+		}
+	}
+
+	/*
+	 * Calls Callback(Entity, Distance) for the Count entities closest to Point,
+	 * nearest first, Distance being the distance to the entity's box. Rings of
+	 * cells around the point's cell are searched outwards until the next ring
+	 * cannot hold anything closer than the current Count-th best, so the work
+	 * depends on the local density and not on the size of the world. Every
+	 * layer and level is searched in its own cells.
+	 */
+	template<typename Fn>
+	void
+	QueryNearest(
+		UGridPos Point,
+		uint32_t Count,
+		Fn&& Callback
+		)
+	{
+		if(Count == 0)
+		{
+			return;
+		}
+
+		struct Hit
+		{
+			float DistanceSquared;
+			uint32_t Index;
+
+			bool
+			operator<(
+				const Hit& Other
+				) const
+			{
+				return this->DistanceSquared < Other.DistanceSquared;
+			}
+		};
+
+		/*
+		 * Max heap of the best Count so far, the worst one on top.
+		 */
+		ScratchList<Hit> Best(this->Cells.GetAllocator());
+		Best.reserve(Count);
+
+		auto VisitLayer = [&](UGrid& Layer, uint32_t X, uint32_t Y)
+		{
+			uint32_t i = Layer.GetHead(X, Y);
+			while(i)
+			{
+				UGridReference& Reference = Layer.References[i];
+				i = Reference.Next;
+
+				float DistanceSquared = GetDistanceSquared(Layer.Entities.GetPos(Reference.Ref), Layer.Entities.GetDim(Reference.Ref), Point);
+				bool Full = Best.size() == Count;
+				if(Full && DistanceSquared >= Best.front().DistanceSquared)
+				{
+					continue;
+				}
+
+				uint32_t Index = Reference.Ref | Layer.LayerBit;
+
+				/*
+				 * Entities spanning several cells come back, but only ones
+				 * closer than the worst kept need checking, an entity evicted
+				 * earlier cannot be.
+				 */
+				if(std::find_if(Best.begin(), Best.end(), [&](const Hit& Other)
+				{
+					return Other.Index == Index;
+				}) != Best.end())
+				{
+					continue;
+				}
+
+				if(Full)
+				{
+					std::pop_heap(Best.begin(), Best.end());
+					Best.pop_back();
+				}
+
+				Best.push_back({ DistanceSquared, Index });
+				std::push_heap(Best.begin(), Best.end());
+			}
+		};
+
+		/*
+		 * Layers are searched one after the other in their own cells, every
+		 * one starting out with the best of the ones before. Rings are
+		 * clipped to the layer's occupied cells, once a ring covers all of
+		 * them there is nothing left to find.
+		 */
+		this->ForEachLayer([&](UGrid& Layer)
+		{
+			if(Layer.Entities.GetUsed() == 1)
+			{
+				return;
+			}
+
+			UGridCell Center = Layer.PosToCell(Point);
+			UGridCell Min = Layer.Cells.GetMin();
+			UGridCell Max = Layer.Cells.GetMax();
+
+			for(int64_t Ring = 0; ; ++Ring)
+			{
+				int64_t X0 = int64_t(Center.X) - Ring;
+				int64_t X1 = int64_t(Center.X) + Ring;
+				int64_t Y0 = int64_t(Center.Y) - Ring;
+				int64_t Y1 = int64_t(Center.Y) + Ring;
+
+				if(X0 < Min.X && X1 > Max.X && Y0 < Min.Y && Y1 > Max.Y)
+				{
+					break;
+				}
+
+				if(Best.size() == Count && Ring > 0)
+				{
+					/*
+					 * Every cell of the ring lies past one of its sides,
+					 * which bounds how close anything registered there can
+					 * be, less what loose cells let boxes reach out.
+					 */
+					float Closest = INFINITY;
+					if(X0 >= Min.X)
+					{
+						Closest = std::min(Closest, Point.X - Layer.GetColumnStart(X0 + 1) - Layer.LooseDim.W);
+					}
+					if(X1 <= Max.X)
+					{
+						Closest = std::min(Closest, Layer.GetColumnStart(X1) - Point.X - Layer.LooseDim.W);
+					}
+					if(Y0 >= Min.Y)
+					{
+						Closest = std::min(Closest, Point.Y - Layer.GetRowStart(Y0 + 1) - Layer.LooseDim.H);
+					}
+					if(Y1 <= Max.Y)
+					{
+						Closest = std::min(Closest, Layer.GetRowStart(Y1) - Point.Y - Layer.LooseDim.H);
+					}
+
+					Closest = std::max(Closest, 0.0f);
+					if(Closest * Closest > Best.front().DistanceSquared)
+					{
+						break;
+					}
+				}
+
+				for(int64_t X = std::max<int64_t>(X0, Min.X); X <= std::min<int64_t>(X1, Max.X); ++X)
+				{
+					if(X == X0 || X == X1)
+					{
+						for(int64_t Y = std::max<int64_t>(Y0, Min.Y); Y <= std::min<int64_t>(Y1, Max.Y); ++Y)
+						{
+							VisitLayer(Layer, X, Y);
+						}
+					}
+					else
+					{
+						if(Y0 >= Min.Y)
+						{
+							VisitLayer(Layer, X, Y0);
+						}
+						if(Y1 <= Max.Y)
+						{
+							VisitLayer(Layer, X, Y1);
+						}
+					}
+				}
+			}
+		});
+
+		std::sort_heap(Best.begin(), Best.end());
+		for(const Hit& Next : Best)
+		{
+			Callback(this->GetEntity(Next.Index), std::sqrt(Next.DistanceSquared));
+		}
+	}
+
+	/*
+	 * Calls Callback(Entity, Distance) for every entity whose box the ray from
+	 * Origin along Direction hits within MaxDistance, in order of increasing
+	 * distance. Distances are measured in units of length, Direction need not
+	 * be normalized. Cells are visited front to back with a DDA and a hit is
+	 * reported as soon as the ray has left every cell it could be beaten in,
+	 * so returning false from the callback, for example at the first hit,
+	 * stops the walk right there. The callback must not modify the grid.
+	 */
+	template<typename Fn>
+	void
+	Raycast(
+		UGridPos Origin,
+		UGridPos Direction,
+		float MaxDistance,
+		Fn&& Callback
+		)
+	{
+		float Length = std::sqrt(Direction.X * Direction.X + Direction.Y * Direction.Y);
+		if(!(Length > 0.0f))
+		{
+			return;
+		}
+
+		Direction = { Direction.X / Length, Direction.Y / Length };
+
+		struct Hit
+		{
+			float Distance;
+			uint32_t Index;
+
+			bool
+			operator<(
+				const Hit& Other
+				) const
+			{
+				return this->Distance < Other.Distance;
+			}
+		};
+
+		/*
+		 * Every hit so far, the ones before Delivered were already reported
+		 * and the rest are kept sorted. Doubles as the list of entities seen
+		 * in earlier cells, rays rarely hit enough for the scan to matter.
+		 */
+		ScratchList<Hit> Hits(this->Cells.GetAllocator());
+		uint32_t Delivered = 0;
+
+		uint32_t Before = 0;
+		auto VisitLayer = [&](UGrid& Layer, UGridCell Cell)
+		{
+			uint32_t i = Layer.GetHead(Cell.X, Cell.Y);
+			while(i)
+			{
+				UGridReference& Reference = Layer.References[i];
+				i = Reference.Next;
+				uint32_t Index = Reference.Ref | Layer.LayerBit;
+
+				float Distance;
+				if(
+					!IntersectsRay(Layer.Entities.GetPos(Reference.Ref), Layer.Entities.GetDim(Reference.Ref), Origin, Direction, Distance) ||
+					Distance > MaxDistance ||
+					std::find_if(Hits.begin(), Hits.begin() + Before, [&](const Hit& Other)
+					{
+						return Other.Index == Index;
+					}) != Hits.begin() + Before
+					)
+				{
+					continue;
+				}
+
+				if(Hits.capacity() == 0)
+				{
+					Hits.reserve(16);
+				}
+
+				Hits.push_back({ Distance, Index });
+			}
+		};
+
+		/*
+		 * Every layer is walked through its own cells. The walk whose cell
+		 * the ray leaves first is the one advanced, so hits are delivered
+		 * once the ray has left every cell of every layer they could be
+		 * beaten in. Exit is where the ray leaves the current cell, infinity
+		 * once nothing else can be hit in the layer.
+		 */
+		struct Walk
+		{
+			UGrid* Layer;
+			UGridCell Cell;
+			float ColumnExit;
+			float RowExit;
+			float Exit;
+		};
+
+		auto VisitWalk = [&](Walk& Next)
+		{
+			UGrid& Layer = *Next.Layer;
+
+			/* Boxes in loose cells reach into the cells around theirs */
+			UGridCell Min = Layer.Cells.GetMin();
+			UGridCell Max = Layer.Cells.GetMax();
+			UGridCell Reach = Layer.GetReach(Layer.LooseDim);
+			int64_t X0 = int64_t(Next.Cell.X) - Reach.X;
+			int64_t X1 = int64_t(Next.Cell.X) + Reach.X;
+			int64_t Y0 = int64_t(Next.Cell.Y) - Reach.Y;
+			int64_t Y1 = int64_t(Next.Cell.Y) + Reach.Y;
+
+			Before = Hits.size();
+			for(int64_t X = std::max<int64_t>(X0, Min.X); X <= std::min<int64_t>(X1, Max.X); ++X)
+			{
+				for(int64_t Y = std::max<int64_t>(Y0, Min.Y); Y <= std::min<int64_t>(Y1, Max.Y); ++Y)
+				{
+					VisitLayer(Layer, { uint32_t(X), uint32_t(Y) });
+				}
+			}
+
+			if(Hits.size() != Before)
+			{
+				std::sort(Hits.begin() + Delivered, Hits.end());
+			}
+
+			/* Past the occupied cells and heading away from them nothing
+			 * else can be hit, which ends walks through unbounded cells */
+			Next.Exit = std::min(Next.ColumnExit, Next.RowExit);
+			if(
+				(X1 < Min.X && Direction.X <= 0.0f) || (X0 > Max.X && Direction.X >= 0.0f) ||
+				(Y1 < Min.Y && Direction.Y <= 0.0f) || (Y0 > Max.Y && Direction.Y >= 0.0f)
+				)
+			{
+				Next.Exit = INFINITY;
+			}
+		};
+
+		ScratchList<Walk> Walks(this->Cells.GetAllocator());
+		this->ForEachLayer([&](UGrid& Layer)
+		{
+			if(Layer.Entities.GetUsed() == 1)
+			{
+				return;
+			}
+
+			UGridCell Cell = Layer.PosToCell(Origin);
+			Walks.push_back({
+				&Layer,
+				Cell,
+				Layer.GetColumnExit(Cell.X, Origin.X, Direction.X),
+				Layer.GetRowExit(Cell.Y, Origin.Y, Direction.Y),
+				INFINITY
+			});
+			VisitWalk(Walks.back());
+		});
+
+		while(true)
+		{
+			Walk* First = nullptr;
+			float Exit = INFINITY;
+			for(Walk& Next : Walks)
+			{
+				if(Next.Exit < Exit)
+				{
+					First = &Next;
+					Exit = Next.Exit;
+				}
+			}
+
+			float Limit = std::min(Exit, MaxDistance);
+
+			while(Delivered < Hits.size() && Hits[Delivered].Distance <= Limit)
+			{
+				Hit Next = Hits[Delivered++];
+
+				if(!Callback(this->GetEntity(Next.Index), Next.Distance))
+				{
+					return;
+				}
+			}
+
+			if(Exit > MaxDistance || Exit == INFINITY)
+			{
+				return;
+			}
+
+			uint32_t StepX = First->ColumnExit <= First->RowExit ? (Direction.X > 0.0f ? 1 : -1) : 0;
+			uint32_t StepY = First->RowExit <= First->ColumnExit ? (Direction.Y > 0.0f ? 1 : -1) : 0;
+
+			/* Through a corner the ray touches the cells on both sides of
+			 * it before going on diagonally */
+			if(StepX && StepY)
+			{
+				UGridCell Cell = First->Cell;
+				First->Cell = { Cell.X + StepX, Cell.Y };
+				VisitWalk(*First);
+				First->Cell = { Cell.X, Cell.Y + StepY };
+				VisitWalk(*First);
+				First->Cell = Cell;
+			}
+
+			if(StepX)
+			{
+				First->Cell.X += StepX;
+				First->ColumnExit = First->Layer->GetColumnExit(First->Cell.X, Origin.X, Direction.X);
+			}
+
+			if(StepY)
+			{
+				First->Cell.Y += StepY;
+				First->RowExit = First->Layer->GetRowExit(First->Cell.Y, Origin.Y, Direction.Y);
+			}
+
+			VisitWalk(*First);
+		}
+	}
+
+	/*
+	 * Calls Callback(A, B) once for every pair of entities sharing a cell
+	 * whose filters let them collide. If Exact is set, pairs whose boxes do
+	 * not overlap are dropped first, using SIMD to test an entity against
+	 * several cell-mates at once. Entities of different levels share no
+	 * cell, they are paired when their boxes overlap, whether Exact is set or
+	 * not. Sleeping entities overlapped by an awake one are woken up after
+	 * the last callback. The callback must not modify the grid.
+	 */
+	template<bool Exact = false, typename Fn>
+	void
+	Tick(
+		Fn&& Callback
+		)
+	{
+		uint32_t Count = this->Levels.size() + 1;
+		for(uint32_t Level = 0; Level < Count; ++Level)
+		{
+			this->GetLevelGrid(Level).Optimize();
+		}
+		this->OptimizeStatic();
+
+		this->Wakes.clear();
+		for(uint32_t Level = 0; Level < Count; ++Level)
+		{
+			UGrid& Grid = this->GetLevelGrid(Level);
+			Grid.template TickColumns<Exact>(0, Grid.Cells.GetLast().X + 1, 0, this->GetStaticLevel(Level), Callback, this->Wakes);
+		}
+
+		for(auto [Iterated, Queried] : this->GetLevelPairs())
+		{
+			this->TickLevels(*Iterated, *Queried, 1, Iterated->Entities.GetUsed(), Callback, this->Wakes);
+		}
+
+		this->WakeAll(this->Wakes);
+	}
+
+	/*
+	 * Same as Tick(), but the grid is split into strips of columns that are
+	 * processed by ThreadCount threads at once. Every strip works out which
+	 * entities started before it from the entity order, so the pairs reported
+	 * are exactly the ones Tick() reports. Callback is called concurrently as
+	 * Callback(Thread, A, B), where Thread is below ThreadCount and no two
+	 * calls with the same Thread overlap.
+	 */
+	template<bool Exact = false, typename Fn>
+	void
+	Tick(
+		Fn&& Callback,
+		uint32_t ThreadCount
+		)
+	{
+		ThreadCount = std::max(ThreadCount, 1u);
+
+		uint32_t Count = this->Levels.size() + 1;
+		ScratchList<uint32_t> LevelThreads(Count, this->Cells.GetAllocator());
+		for(uint32_t Level = 0; Level < Count; ++Level)
+		{
+			UGrid& Grid = this->GetLevelGrid(Level);
+			LevelThreads[Level] = Grid.LimitThreads(ThreadCount);
+			Grid.Optimize(LevelThreads[Level]);
+		}
+		this->OptimizeStatic();
+
+		ScratchList<WakeList> ThreadWakes(ThreadCount, WakeList(this->Cells.GetAllocator()), this->Cells.GetAllocator());
+
+		for(uint32_t Level = 0; Level < Count; ++Level)
+		{
+			UGrid& Grid = this->GetLevelGrid(Level);
+			UGrid* StaticLevel = this->GetStaticLevel(Level);
+			uint32_t GridThreads = LevelThreads[Level];
+
+			this->RunThreads(GridThreads, [&](uint32_t Thread)
+			{
+				uint32_t XBegin = Grid.GetStripBegin(Thread, GridThreads);
+				uint32_t XEnd = Grid.GetStripBegin(Thread + 1, GridThreads);
+
+				auto ThreadCallback = [&](EntityType& A, EntityType& B)
+				{
+					Callback(Thread, A, B);
+				};
+
+				Grid.template TickColumns<Exact>(XBegin, XEnd, Grid.GetMaxEntityIndexBefore(XBegin), StaticLevel, ThreadCallback, ThreadWakes[Thread]);
+			});
+		}
+
+		/* Pairs across levels split the iterated entities between threads */
+		ScratchList<std::pair<UGrid*, UGrid*>> Pairs = this->GetLevelPairs();
+		if(!Pairs.empty())
+		{
+			this->RunThreads(ThreadCount, [&](uint32_t Thread)
+			{
+				auto ThreadCallback = [&](EntityType& A, EntityType& B)
+				{
+					Callback(Thread, A, B);
+				};
+
+				for(auto [Iterated, Queried] : Pairs)
+				{
+					uint64_t Used = Iterated->Entities.GetUsed() - 1;
+					uint32_t Begin = 1 + Used * Thread / ThreadCount;
+					uint32_t End = 1 + Used * (Thread + 1) / ThreadCount;
+					this->TickLevels(*Iterated, *Queried, Begin, End, ThreadCallback, ThreadWakes[Thread]);
+				}
+			});
+		}
+
+		for(const WakeList& Wakes : ThreadWakes)
+		{
+			this->WakeAll(Wakes);
+		}
+	}
+
+	/*
+	 * Runs an exact Tick() and compares the overlapping pairs, keyed on their
+	 * handles, with the ones found by the previous call. Begin(A, B) is called
+	 * for pairs that started overlapping, Stay(A, B) for pairs that still do
+	 * and End(HandleA, HandleB) for pairs that stopped, which includes pairs
+	 * with an entity removed in between, so the handles passed to End may no
+	 * longer be valid. Contacts between a sleeping entity and a static or
+	 * sleeping one stay as long as the boxes still overlap, although Tick()
+	 * does not pair them. No callback may modify the grid.
+	 */
+	template<typename BeginFn, typename EndFn, typename StayFn>
+	void
+	TickContacts(
+		BeginFn&& Begin,
+		EndFn&& End,
+		StayFn&& Stay
+		)
+	{
+		this->NewContacts.clear();
+
+		/* Checked before Tick() wakes anything up, the pairs it wakes up
+		 * were not paired this time either */
+		for(const UGridContact& Contact : this->Contacts)
+		{
+			if(
+				!this->IsValid(Contact.A) || !this->IsValid(Contact.B) ||
+				!this->IsStatic(Contact.A) || !this->IsStatic(Contact.B)
+				)
+			{
+				continue;
+			}
+
+			EntityType& A = this->Get(Contact.A);
+			EntityType& B = this->Get(Contact.B);
+			if(
+				(A.Sleeping || B.Sleeping) &&
+				Overlaps(A.Pos, A.Dim, B.Pos, B.Dim) &&
+				Collides(this->GetFilter(Contact.A), this->GetFilter(Contact.B))
+				)
+			{
+				this->NewContacts.push_back(Contact);
+			}
+		}
+
+		this->template Tick<true>([&](EntityType& A, EntityType& B)
+		{
+			UGridHandle HandleA = { A.Handle, this->Handles[A.Handle].Generation };
+			UGridHandle HandleB = { B.Handle, this->Handles[B.Handle].Generation };
+			if(HandleB.Index < HandleA.Index)
+			{
+				std::swap(HandleA, HandleB);
+			}
+
+			this->NewContacts.push_back({ HandleA, HandleB });
+		});
+
+		std::sort(this->NewContacts.begin(), this->NewContacts.end());
+
+		auto Old = this->Contacts.begin();
+		auto New = this->NewContacts.begin();
+
+		while(Old != this->Contacts.end() || New != this->NewContacts.end())
+		{
+			if(New == this->NewContacts.end() || (Old != this->Contacts.end() && *Old < *New))
+			{
+				End(Old->A, Old->B);
+				++Old;
+			}
+			else if(Old == this->Contacts.end() || *New < *Old)
+			{
+				Begin(this->Get(New->A), this->Get(New->B));
+				++New;
+			}
+			else
+			{
+				Stay(this->Get(New->A), this->Get(New->B));
+				++Old;
+				++New;
+			}
+		}
+
+		std::swap(this->Contacts, this->NewContacts);
+	}
+
+	template<typename BeginFn, typename EndFn>
+	void
+	TickContacts(
+		BeginFn&& Begin,
+		EndFn&& End
+		)
+	{
+		this->TickContacts(Begin, End, [](EntityType&, EntityType&)
+		{
+		});
 	}
 };